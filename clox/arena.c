@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+void initArena(Arena* arena) {
+  arena->blocks = NULL;
+  arena->next = NULL;
+  arena->end = NULL;
+  arena->last = NULL;
+}
+
+static void newBlock(Arena* arena, size_t size) {
+  size_t blockSize = ARENA_ALIGN(sizeof(ArenaBlock)) + size;
+  if (blockSize < ARENA_BLOCK_SIZE) blockSize = ARENA_BLOCK_SIZE;
+
+  ArenaBlock* block = (ArenaBlock*)malloc(blockSize);
+  if (block == NULL) exit(1);
+  block->size = blockSize;
+  block->next = arena->blocks;
+  arena->blocks = block;
+
+  arena->next = (char*)block + ARENA_ALIGN(sizeof(ArenaBlock));
+  arena->end = (char*)block + blockSize;
+}
+
+void* arenaAllocate(Arena* arena, size_t size) {
+  size = ARENA_ALIGN(size);
+  if ((size_t)(arena->end - arena->next) < size) newBlock(arena, size);
+
+  void* result = arena->next;
+  arena->next += size;
+  arena->last = result;
+  return result;
+}
+
+// Arena memory is only freed all at once, so growing copies unless the
+// array is the latest allocation and there is room after it.
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize) {
+  if (pointer != NULL && pointer == arena->last &&
+      (size_t)(arena->end - (char*)pointer) >= ARENA_ALIGN(newSize)) {
+    arena->next = (char*)pointer + ARENA_ALIGN(newSize);
+    return pointer;
+  }
+
+  void* result = arenaAllocate(arena, newSize);
+  if (oldSize > 0) memcpy(result, pointer, oldSize);
+  return result;
+}
+
+// Frees everything but one block, which the next user starts from.
+void resetArena(Arena* arena) {
+  if (arena->blocks == NULL) return;
+
+  ArenaBlock* keep = arena->blocks;
+  ArenaBlock* block = keep->next;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    if (block->size > keep->size) {
+      free(keep);
+      keep = block;
+    } else {
+      free(block);
+    }
+    block = next;
+  }
+
+  keep->next = NULL;
+  arena->blocks = keep;
+  arena->next = (char*)keep + ARENA_ALIGN(sizeof(ArenaBlock));
+  arena->end = (char*)keep + keep->size;
+  arena->last = NULL;
+}
+
+void freeArena(Arena* arena) {
+  ArenaBlock* block = arena->blocks;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  initArena(arena);
+}
@@ -0,0 +1,38 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common.h"
+
+// Bump allocator for memory that lives only while something is being
+// built, like the compiler's locals. It is plain malloc memory outside the
+// garbage collector: allocating never starts a collection and nothing in
+// it is a root.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock {
+  ArenaBlock* next;
+  size_t size;
+};
+
+typedef struct {
+  ArenaBlock* blocks;
+  char* next;
+  char* end;
+  void* last; // the latest allocation, which can grow in place
+} Arena;
+
+#define ARENA_ALLOCATE(arena, type, count) \
+  (type*)arenaAllocate(arena, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(arena, type, pointer, oldCount, newCount) \
+  (type*)arenaGrow(arena, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+
+void initArena(Arena* arena);
+void* arenaAllocate(Arena* arena, size_t size);
+void* arenaGrow(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+void resetArena(Arena* arena);
+void freeArena(Arena* arena);
+
+#endif
@@ -0,0 +1,241 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "common.h"
+#include "file.h"
+#include "vm.h"
+
+typedef struct {
+  const char* path;
+  char* out;
+  size_t outSize;
+  char* err;
+  size_t errSize;
+  int status;
+  double millis;
+  bool done;
+} Script;
+
+// Every worker owns a contiguous range of scripts. The owner takes from the
+// front of its range and idle workers steal from the back, so a worker
+// mostly runs scripts in order and output can be flushed early.
+typedef struct {
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+} WorkQueue;
+
+typedef struct {
+  Script* scripts;
+  int count;
+  WorkQueue* queues;
+  int jobs;
+
+  pthread_mutex_t doneLock;
+  pthread_cond_t doneCond;
+} Batch;
+
+typedef struct {
+  Batch* batch;
+  int id;
+  pthread_t thread;
+} Worker;
+
+static double elapsedMillis(struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1000.0 +
+    (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int takeOwn(WorkQueue* queue) {
+  int index = -1;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) index = queue->head++;
+  pthread_mutex_unlock(&queue->lock);
+  return index;
+}
+
+static int steal(WorkQueue* queue) {
+  int index = -1;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) index = --queue->tail;
+  pthread_mutex_unlock(&queue->lock);
+  return index;
+}
+
+static int nextScript(Worker* worker) {
+  Batch* batch = worker->batch;
+  int index = takeOwn(&batch->queues[worker->id]);
+  if (index != -1) return index;
+
+  for (int i = 1; i < batch->jobs; i++) {
+    index = steal(&batch->queues[(worker->id + i) % batch->jobs]);
+    if (index != -1) return index;
+  }
+  return -1;
+}
+
+static void runScript(Script* script) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  vm.out = open_memstream(&script->out, &script->outSize);
+  vm.err = open_memstream(&script->err, &script->errSize);
+
+  Source source;
+  if (!openSource(script->path, &source)) {
+    script->status = 74;
+  } else {
+    InterpretResult result = source.text != NULL
+      ? interpret(source.text, source.length)
+      : interpretStream(source.fd);
+    closeSource(&source);
+    if (result == INTERPRET_COMPILE_ERROR) script->status = 65;
+    else if (result == INTERPRET_RUNTIME_ERROR) script->status = 70;
+    else script->status = 0;
+  }
+
+  fclose(vm.out);
+  fclose(vm.err);
+  vm.out = stdout;
+  vm.err = stderr;
+  resetVM();
+
+  script->millis = elapsedMillis(&start);
+}
+
+static void* workerMain(void* arg) {
+  Worker* worker = (Worker*)arg;
+  Batch* batch = worker->batch;
+  initVM();
+
+  int index;
+  while ((index = nextScript(worker)) != -1) {
+    Script* script = &batch->scripts[index];
+    runScript(script);
+
+    pthread_mutex_lock(&batch->doneLock);
+    script->done = true;
+    pthread_cond_broadcast(&batch->doneCond);
+    pthread_mutex_unlock(&batch->doneLock);
+  }
+
+  freeVM();
+  return NULL;
+}
+
+// Writes the results in script order as soon as each one is finished.
+static int reportResults(Batch* batch) {
+  int status = 0;
+  int failed = 0;
+
+  for (int i = 0; i < batch->count; i++) {
+    Script* script = &batch->scripts[i];
+
+    pthread_mutex_lock(&batch->doneLock);
+    while (!script->done) {
+      pthread_cond_wait(&batch->doneCond, &batch->doneLock);
+    }
+    pthread_mutex_unlock(&batch->doneLock);
+
+    fwrite(script->out, 1, script->outSize, stdout);
+    fflush(stdout);
+    fwrite(script->err, 1, script->errSize, stderr);
+    fprintf(stderr, "[batch] %s: exit %d, %.3f ms\n",
+        script->path, script->status, script->millis);
+    free(script->out);
+    free(script->err);
+
+    if (script->status != 0) {
+      failed++;
+      if (status == 0) status = script->status;
+    }
+  }
+
+  fprintf(stderr, "[batch] %d scripts, %d failed\n", batch->count, failed);
+  return status;
+}
+
+int runBatch(const char** paths, int count, int jobs) {
+  if (jobs <= 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > count) jobs = count;
+  if (jobs < 1) jobs = 1;
+
+  Batch batch;
+  batch.count = count;
+  batch.jobs = jobs;
+  batch.scripts = calloc(count, sizeof(Script));
+  batch.queues = malloc(sizeof(WorkQueue) * jobs);
+  Worker* workers = malloc(sizeof(Worker) * jobs);
+  if (batch.scripts == NULL || batch.queues == NULL || workers == NULL) {
+    fprintf(stderr, "Not enough memory for %d scripts.\n", count);
+    exit(74);
+  }
+  pthread_mutex_init(&batch.doneLock, NULL);
+  pthread_cond_init(&batch.doneCond, NULL);
+
+  for (int i = 0; i < count; i++) {
+    batch.scripts[i].path = paths[i];
+  }
+
+  for (int i = 0; i < jobs; i++) {
+    pthread_mutex_init(&batch.queues[i].lock, NULL);
+    batch.queues[i].head = (int)((long)count * i / jobs);
+    batch.queues[i].tail = (int)((long)count * (i + 1) / jobs);
+  }
+
+  for (int i = 0; i < jobs; i++) {
+    workers[i].batch = &batch;
+    workers[i].id = i;
+    pthread_create(&workers[i].thread, NULL, workerMain, &workers[i]);
+  }
+
+  int status = reportResults(&batch);
+
+  // A worker still running may steal from the queue of one that is done.
+  for (int i = 0; i < jobs; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  for (int i = 0; i < jobs; i++) {
+    pthread_mutex_destroy(&batch.queues[i].lock);
+  }
+
+  pthread_cond_destroy(&batch.doneCond);
+  pthread_mutex_destroy(&batch.doneLock);
+  free(workers);
+  free(batch.queues);
+  free(batch.scripts);
+  return status;
+}
+
+// One script path per line. Empty lines and lines starting with '#' are
+// skipped.
+const char** readManifest(const char* path, int* count) {
+  char* source = readFile(path);
+  if (source == NULL) return NULL;
+
+  int capacity = 8;
+  const char** paths = malloc(sizeof(char*) * capacity);
+  *count = 0;
+
+  char* line = strtok(source, "\r\n");
+  while (line != NULL) {
+    if (line[0] != '\0' && line[0] != '#') {
+      if (*count == capacity) {
+        capacity *= 2;
+        paths = realloc(paths, sizeof(char*) * capacity);
+      }
+      paths[(*count)++] = strdup(line);
+    }
+    line = strtok(NULL, "\r\n");
+  }
+
+  free(source);
+  return paths;
+}
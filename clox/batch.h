@@ -0,0 +1,7 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+int runBatch(const char** paths, int count, int jobs);
+const char** readManifest(const char* path, int* count);
+
+#endif
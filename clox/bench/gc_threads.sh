@@ -0,0 +1,8 @@
+#!/bin/sh
+# Mark pause times of bench/gc_tree.lox for different marker thread counts.
+# Build without the DEBUG_* flags in common.h to get meaningful numbers.
+cd "$(dirname "$0")/.."
+for threads in 1 2 4 8; do
+  printf "%d threads: " $threads
+  ./clox.sh --gc-threads $threads --gc-stats bench/gc_tree.lox 2>&1 >/dev/null
+done
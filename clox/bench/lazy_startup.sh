@@ -0,0 +1,23 @@
+#!/bin/bash
+# Startup of a large library script of which only two functions run,
+# compiled eagerly and with --lazy. Build without the DEBUG_* flags in
+# common.h.
+cd "$(dirname "$0")/.."
+library=/tmp/clox_lazy_library.lox
+awk 'BEGIN {
+  for (f = 0; f < 120; f++) {
+    printf "fun helper%d(a, b) {\n", f
+    for (i = 0; i < 200; i++) {
+      printf "  if (a < %d) { var x%d = a * b + %d; b = x%d - a; } else { a = a - 1; }\n", i, i, i, i
+    }
+    printf "  return a + b;\n}\n\n"
+  }
+  print "print helper0(1, 2);"
+  print "print helper1(3, 4);"
+}' > $library
+TIMEFORMAT="%R s"
+for mode in "" --lazy; do
+  echo "${mode:-eager}:"
+  time ./clox.sh $mode $library
+done
+rm -f $library
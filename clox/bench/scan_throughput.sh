@@ -0,0 +1,34 @@
+#!/bin/sh
+# Scanner throughput in MB/s over large generated scripts: one dense with
+# short tokens, one with long comments, indentation and strings, and a
+# numeric table (the scanner converts number literals). Build
+# with -O2 (and -mavx2 for the AVX2 paths) and without the DEBUG_* flags
+# in common.h.
+cd "$(dirname "$0")/.."
+dense=/tmp/clox_scan_dense.lox
+sparse=/tmp/clox_scan_sparse.lox
+table=/tmp/clox_scan_table.lox
+awk 'BEGIN {
+  for (i = 0; i < 200000; i++) {
+    printf "fun function_%d(first_argument, second_argument) {\n", i
+    printf "  var value = first_argument * 1234.5678 + %d;\n", i
+    printf "  return value + second_argument;\n}\n\n"
+  }
+}' > $dense
+awk 'BEGIN {
+  for (i = 0; i < 300000; i++) {
+    printf "        // A long comment line explaining what happens on the next line %d.\n", i
+    printf "        var s%d = \"a long string literal with plenty of characters to skip\";\n", i
+  }
+}' > $sparse
+awk 'BEGIN {
+  srand(1);
+  for (i = 0; i < 1000000; i++) {
+    printf "  %d, %.6f, %.15f,\n", int(rand() * 100000), rand() * 1000, rand()
+  }
+}' > $table
+./clox.sh --scan $dense
+./clox.sh --scan $sparse
+./clox.sh --scan $table
+cat $sparse | ./clox.sh --scan -
+rm -f $dense $sparse $table
@@ -3,6 +3,8 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
+#include "vm.h"
 
 static void initLines(Lines* lines) {
   lines->count = 0;
@@ -17,6 +19,31 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     initValueArray(&chunk->constants);
     initLines(&chunk->lines);
+    chunk->caches = NULL;
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->inlines = NULL;
+    chunk->inlineCount = 0;
+    chunk->inlineCapacity = 0;
+}
+
+static void addLine(Lines* lines, int offset, int line) {
+    if (lines->capacity < lines->count + 1) {
+      int oldCapacity = lines->capacity;
+      lines->capacity = GROW_CAPACITY(oldCapacity);
+      lines->lines = GROW_ARRAY(int, lines->lines, oldCapacity, lines->capacity);
+      lines->offsets = GROW_ARRAY(int, lines->offsets, oldCapacity, lines->capacity);
+    }
+
+    lines->lines[lines->count] = line;
+    lines->offsets[lines->count] = offset;
+    lines->count++;
+}
+
+static void freeLines(Lines* lines) {
+   FREE_ARRAY(int, lines->lines, lines->capacity);
+   FREE_ARRAY(int, lines->offsets, lines->capacity);
+   initLines(lines);
 }
 
 static void setLines(Chunk* chunk, int line) {
@@ -24,18 +51,7 @@ static void setLines(Chunk* chunk, int line) {
       return;
     }
 
-    if (chunk->lines.capacity < chunk->lines.count + 1) {
-      int oldCapacity = chunk->lines.capacity;
-      chunk->lines.capacity = GROW_CAPACITY(oldCapacity);
-      chunk->lines.lines = GROW_ARRAY(int, chunk->lines.lines,
-        oldCapacity, chunk->lines.capacity);
-      chunk->lines.offsets = GROW_ARRAY(int, chunk->lines.offsets,
-        oldCapacity, chunk->lines.capacity);
-    }
-
-    chunk->lines.lines[chunk->lines.count] = line;
-    chunk->lines.offsets[chunk->lines.count] = chunk->count;
-    chunk->lines.count++;
+    addLine(&chunk->lines, chunk->count, line);
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -52,15 +68,21 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 
 void freeChunk(Chunk* chunk) {
    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-   FREE_ARRAY(int, chunk->lines.lines, chunk->lines.count);
-   FREE_ARRAY(int, chunk->lines.offsets, chunk->lines.count);
+   freeLines(&chunk->lines);
+   FREE_ARRAY(PropertyCache, chunk->caches, chunk->cacheCapacity);
+   for (int i = 0; i < chunk->inlineCount; i++) {
+     freeLines(&chunk->inlines[i].lines);
+   }
+   FREE_ARRAY(InlineSite, chunk->inlines, chunk->inlineCapacity);
    freeValueArray(&chunk->constants);
    initChunk(chunk);
 }
 
 static int valueIndex(ValueArray* array, Value value) {
   for (int i = 0; i < array->count; i++) {
-    if (valuesEqual(value, array->values[i])) return i;
+    // 1 and 1.0 are equal but not the same constant.
+    if (value.type == array->values[i].type &&
+        valuesEqual(value, array->values[i])) return i;
   }
   return -1;
 }
@@ -68,6 +90,116 @@ static int valueIndex(ValueArray* array, Value value) {
 int addConstant(Chunk* chunk, Value value) {
     int index = valueIndex(&chunk->constants, value);
     if (index != -1) return index;
+    push(value);
     writeValueArray(&chunk->constants, value);
+    pop();
     return chunk->constants.count - 1;
 }
+
+int addCache(Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(PropertyCache, chunk->caches,
+        oldCapacity, chunk->cacheCapacity);
+  }
+
+  PropertyCache* cache = &chunk->caches[chunk->cacheCount];
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    cache->entries[i].shape = NULL;
+    cache->entries[i].klass = NULL;
+    cache->entries[i].method = NULL;
+  }
+  cache->count = 0;
+  return chunk->cacheCount++;
+}
+
+int addInlineSite(Chunk* chunk, int function) {
+  if (chunk->inlineCapacity < chunk->inlineCount + 1) {
+    int oldCapacity = chunk->inlineCapacity;
+    chunk->inlineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->inlines = GROW_ARRAY(InlineSite, chunk->inlines,
+        oldCapacity, chunk->inlineCapacity);
+  }
+
+  InlineSite* site = &chunk->inlines[chunk->inlineCount];
+  site->start = -1;
+  site->end = -1;
+  site->function = function;
+  initLines(&site->lines);
+  return chunk->inlineCount++;
+}
+
+// The next instruction written to the chunk belongs to the inlined body,
+// and line is its line in the callee. The instructions of a body are
+// written one after another, endInlined() follows the last one.
+void markInlined(Chunk* chunk, int site, int line) {
+  InlineSite* inlined = &chunk->inlines[site];
+  if (inlined->start == -1) inlined->start = chunk->count;
+  Lines* lines = &inlined->lines;
+  if (lines->count == 0 || lines->lines[lines->count - 1] != line) {
+    addLine(lines, chunk->count, line);
+  }
+}
+
+void endInlined(Chunk* chunk, int site) {
+  chunk->inlines[site].end = chunk->count;
+}
+
+InlineSite* findInlineSite(Chunk* chunk, int offset) {
+  for (int i = 0; i < chunk->inlineCount; i++) {
+    InlineSite* site = &chunk->inlines[i];
+    if (site->start <= offset && offset < site->end) return site;
+  }
+  return NULL;
+}
+
+int inlinedLine(InlineSite* site, int offset) {
+  int run = 0;
+  while (run + 1 < site->lines.count && site->lines.offsets[run + 1] <= offset) run++;
+  return site->lines.lines[run];
+}
+
+int nextInstruction(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_PEEK:
+    case OP_POKE:
+    case OP_SLIDE:
+    case OP_GET_ENCLOSING:
+    case OP_SET_ENCLOSING:
+    case OP_GET_CAPTURED:
+    case OP_LIST:
+    case OP_MAP:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+      return offset + 2;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      return offset + 4;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return offset + 5;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+      return offset + 3;
+    case OP_CHECK_CALLEE:
+      return offset + 5;
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+      return offset + 2 + 2 * function->upvalueCount;
+    }
+    default:
+      return offset + 1;
+  }
+}
@@ -37,8 +37,64 @@ typedef enum {
     OP_SET_UPVALUE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
+    // Inlined calls, see inlineCall() in compiler.c.
+    OP_CHECK_CALLEE,
+    OP_PEEK,
+    OP_POKE,
+    OP_SLIDE,
+    // Local functions that do not escape, see endLocalFunction().
+    OP_GET_ENCLOSING,
+    OP_SET_ENCLOSING,
+    OP_GET_CAPTURED,
+    // Integers only.
+    OP_BIT_AND,
+    OP_BIT_OR,
+    OP_BIT_XOR,
+    OP_BIT_NOT,
+    OP_SHIFT_LEFT,
+    OP_SHIFT_RIGHT,
+    OP_LIST,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    OP_MAP,
+    OP_CLASS,
+    OP_INHERIT,
+    OP_METHOD,
+    // The name constant is followed by two bytes indexing a
+    // PropertyCache of the chunk.
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    OP_GET_SUPER,
+    // The name and argument count, then a cache index like above.
+    OP_INVOKE,
+    OP_SUPER_INVOKE,
+    // Written over the generic op by run() once it has seen the operand
+    // types, and back on a miss. The compiler never emits these.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_EQUAL_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_ADD_INT,
+    OP_SUBTRACT_INT,
+    OP_MULTIPLY_INT,
+    OP_EQUAL_INT,
+    OP_GREATER_INT,
+    OP_LESS_INT,
 } OpCode;
 
+// How OP_CLOSURE captures each upvalue. The low bit is set for a local of
+// the enclosing function, the high one when only the value is copied, see
+// captureByValue() in compiler.c.
+typedef enum {
+  CAPTURE_UPVALUE,
+  CAPTURE_LOCAL,
+  CAPTURE_VALUE,
+  CAPTURE_LOCAL_VALUE,
+} CaptureKind;
+
 typedef struct {
   int* lines;
   int* offsets;
@@ -46,17 +102,67 @@ typedef struct {
   int capacity;
 } Lines;
 
+struct Shape;
+
+#define CACHE_WAYS 4
+
+// An instance of shape has the property in slot. When a store adds the
+// field, the instance moves to next, otherwise next is shape.
+//
+// The caches of OP_INVOKE and OP_SUPER_INVOKE use klass and method
+// instead, the method found in the class of the receiver. OP_INVOKE also
+// keeps the shape, which shows that no field shadows the method. These
+// are the only heap pointers of a chunk outside the constants, so the
+// function holding the chunk marks them.
+typedef struct {
+  struct Shape* shape;
+  struct Shape* next;
+  int slot;
+  Obj* klass;
+  Obj* method;
+} CacheEntry;
+
+// What a property instruction found for the last shapes it saw, see
+// OP_GET_PROPERTY in vm.c. Empty entries have a NULL shape.
+typedef struct {
+  CacheEntry entries[CACHE_WAYS];
+  int count; // entries written, the oldest one is replaced when all are used
+} PropertyCache;
+
+// The body of a function inlined into the chunk, see inlineCall() in
+// compiler.c. The chunk's own lines are those of the call, lines holds
+// the lines of the body in the callee for stack traces.
+typedef struct {
+  int start; // the body is code[start] up to code[end], -1 when empty
+  int end;
+  int function; // the constant holding the callee
+  Lines lines;
+} InlineSite;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     ValueArray constants;
     Lines lines;
+    PropertyCache* caches;
+    int cacheCount;
+    int cacheCapacity;
+    InlineSite* inlines;
+    int inlineCount;
+    int inlineCapacity;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int addCache(Chunk* chunk);
+int addInlineSite(Chunk* chunk, int function);
+void markInlined(Chunk* chunk, int site, int line);
+void endInlined(Chunk* chunk, int site);
+InlineSite* findInlineSite(Chunk* chunk, int offset);
+int inlinedLine(InlineSite* site, int offset);
+int nextInstruction(Chunk* chunk, int offset);
 
 #endif
@@ -14,5 +14,7 @@
 #define FUNCTION_MAX_PARAMS 50
 #define MAX_FUNCTIONS 50
 #define MAX_CLOSURES 50
+// Seeds hashString(). Fixed rather than random so runs are reproducible.
+#define HASH_SEED 0
 
 #endif
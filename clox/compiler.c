@@ -2,16 +2,17 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
 #include "chunk.h"
 #include "object.h"
+#include "optimizer.h"
 #include "memory.h"
+#include "vm.h"
 
-#ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#endif
 
 typedef struct {
   Token current;
@@ -27,9 +28,13 @@ typedef enum {
   PREC_AND, // and
   PREC_EQUALITY, // == !=
   PREC_COMPARISON, // < > <= >=
+  PREC_BIT_OR, // |
+  PREC_BIT_XOR, // ^
+  PREC_BIT_AND, // &
+  PREC_SHIFT, // << >>
   PREC_TERM, // + -
   PREC_FACTOR, // * /
-  PREC_UNARY, // ! -
+  PREC_UNARY, // ! - ~
   PREC_CALL, // . ()
   PREC_PRIMARY
 } Precedence;
@@ -42,15 +47,27 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
+typedef struct BreakJump BreakJump;
+
+struct BreakJump {
+  int offset;
+  BreakJump* next;
+};
+
 typedef struct {
   bool inLoop;
-  int breakJump;
+  BreakJump* breakJumps;
 } LoopAttrs;
 
 typedef struct {
   Token name;
   int depth;
   bool isCaptured;
+  int captures; // closures that still capture it through an upvalue
+  int reads; // reads other than calling it
+  int closure; // offset of the OP_CLOSURE of a local function, or -1
+  bool assigned; // after its declaration, here or in a closure
+  int start; // the offset where it was declared
 } Local;
 
 typedef struct {
@@ -60,6 +77,8 @@ typedef struct {
 
 typedef enum {
   TYPE_FUNCTION,
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
   TYPE_SCRIPT,
 } FunctionType;
 
@@ -74,31 +93,66 @@ struct Compiler {
   int localCount;
   int localCapacity;
   int scopeDepth;
-  Upvalue upvalues[UINT8_COUNT];
+  Upvalue* upvalues;
+  int upvalueCapacity;
 
-  bool returnStmt;
-  int breakJump;
+  BreakJump* breakJumps;
   bool inLoop;
+
+  LazyBody* lazy; // when compiling a lazy body, for its upvalue names
+  int globalEnd; // the offset after the last OP_GET_GLOBAL, for call()
+  int localEnd; // the same for OP_GET_LOCAL
 };
 
-Parser parser;
-Compiler* current = NULL;
+typedef struct ClassCompiler ClassCompiler;
+
+struct ClassCompiler {
+  ClassCompiler* enclosing;
+  bool hasSuperclass;
+};
+
+// A global function small enough to be copied into its callers, see
+// inlineCall().
+typedef struct {
+  ObjString* name;
+  ObjFunction* function;
+  int constants; // how many constants the body refers to
+} Inline;
+
+typedef struct {
+  Inline* functions;
+  int count;
+  int capacity;
+} Inlines;
+
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+_Thread_local ClassCompiler* currentClass = NULL;
+// Locals, upvalues and jump lists, freed together after compile().
+_Thread_local Arena arena;
+// Only skim function bodies and compile them on the first call.
+static bool lazyCompilation = false;
+// Run the bytecode optimizer on every function, see optimizer.c.
+static bool optimizeCode = false;
+// The inlinable functions of the script being compiled, in the arena.
+_Thread_local Inlines inlines;
+static bool inlineReport = false;
 
 static void errorAt(Token* token, const char* message) {
   if (parser.panicMode) return;
   parser.panicMode = true;
 
-  fprintf(stderr, "[line %d] Error", token->line);
+  fprintf(vm.err, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(vm.err, " at end");
   } else if (token->type == TOKEN_ERROR) {
     // Nothing.
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(vm.err, " at '%.*s'", token->length, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
+  fprintf(vm.err, ": %s\n", message);
   parser.hadError = true;
 }
 
@@ -177,8 +231,14 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+// An initializer returns the instance, in slot 0.
 static void emitReturn() {
-  emitBytes(OP_NIL, OP_RETURN);
+  if (current->type == TYPE_INITIALIZER) {
+    emitBytes(OP_GET_LOCAL, 0);
+  } else {
+    emitByte(OP_NIL);
+  }
+  emitByte(OP_RETURN);
 }
 
 static int emitJump(OpCode instruction) {
@@ -223,15 +283,154 @@ static uint8_t identifierConstant(Token* token) {
   return makeConstant(OBJ_VAL(copyString(token->start, token->length)));
 }
 
+static void emitCache() {
+  int cache = addCache(currentChunk());
+  if (cache > UINT16_MAX) error("Too many property accesses in one chunk.");
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+// A property instruction and a new cache for it.
+static void emitProperty(OpCode op, uint8_t name) {
+  emitBytes(op, name);
+  emitCache();
+}
+
+static void emitInvoke(OpCode op, uint8_t name, uint8_t argCount) {
+  emitBytes(op, name);
+  emitByte(argCount);
+  emitCache();
+}
+
 static bool identifiersEqual(Token* first, Token* second) {
   return first->length == second->length &&
     memcmp(first->start, second->start, first->length) == 0;
 }
 
+// A local function that is only ever called by the function declaring it
+// runs right above the frame of that function while it lives. It can read
+// and write the variables it captures in that frame, so it needs no
+// upvalues and one closure without them serves every call. Decided when
+// the local goes out of scope, when all its uses have been seen.
+static void endLocalFunction(Local* local) {
+  if (local->closure == -1 || local->reads > 0 || local->isCaptured) return;
+
+  Chunk* chunk = currentChunk();
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[local->closure + 1]]);
+  uint8_t* captures = &chunk->code[local->closure + 2];
+  int upvalueCount = function->upvalueCount;
+  if (function->lazy != NULL || chunk->constants.count == UINT8_COUNT) return;
+
+  // Only variables of this frame, and none for closures inside it.
+  for (int i = 0; i < upvalueCount; i++) {
+    if (!(captures[2 * i] & CAPTURE_LOCAL)) return;
+  }
+  Chunk* body = &function->chunk;
+  for (int offset = 0; offset < body->count; offset = nextInstruction(body, offset)) {
+    if (body->code[offset] != OP_CLOSURE) continue;
+    ObjFunction* inner = AS_FUNCTION(body->constants.values[body->code[offset + 1]]);
+    for (int i = 0; i < inner->upvalueCount; i++) {
+      if (!(body->code[offset + 2 + 2 * i] & CAPTURE_LOCAL)) return;
+    }
+  }
+
+  for (int offset = 0; offset < body->count; offset = nextInstruction(body, offset)) {
+    uint8_t* code = &body->code[offset];
+    if (code[0] == OP_GET_UPVALUE || code[0] == OP_SET_UPVALUE) {
+      code[0] = code[0] == OP_GET_UPVALUE ? OP_GET_ENCLOSING : OP_SET_ENCLOSING;
+      code[1] = captures[2 * code[1] + 1];
+    }
+  }
+  for (int i = 0; i < upvalueCount; i++) {
+    current->locals[captures[2 * i + 1]].captures--;
+  }
+
+  // The closure becomes a constant. The upvalue bytes after it are
+  // jumped over, or a pair of them is a push and a pop. Whatever is
+  // jumped over still has to decode as instructions for the code that
+  // walks the chunk, like the optimizer, so it is filled with OP_NIL.
+  function->upvalueCount = 0;
+  uint8_t constant = makeConstant(OBJ_VAL(newClosure(function)));
+  uint8_t* code = &chunk->code[local->closure];
+  local->closure = -1;
+  code[0] = OP_CONSTANT;
+  code[1] = constant;
+  int skipped = 2 * upvalueCount;
+  if (skipped == 2) {
+    code[2] = OP_NIL;
+    code[3] = OP_POP;
+  } else if (skipped > 2) {
+    int jump = skipped - 3;
+    code[2] = OP_JUMP;
+    code[3] = (jump >> 8) & 0xff;
+    code[4] = jump & 0xff;
+    memset(&code[5], OP_NIL, jump);
+  }
+}
+
+// The closures created from function read the upvalue as a copy. So do
+// the closures inside it that capture the upvalue in turn.
+static void copyUpvalue(ObjFunction* function, int upvalue) {
+  function->valueCount++;
+
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count; offset = nextInstruction(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    if (code[0] == OP_GET_UPVALUE && code[1] == upvalue) {
+      code[0] = OP_GET_CAPTURED;
+    } else if (code[0] == OP_CLOSURE) {
+      ObjFunction* inner = AS_FUNCTION(chunk->constants.values[code[1]]);
+      for (int i = 0; i < inner->upvalueCount; i++) {
+        uint8_t* capture = &code[2 + 2 * i];
+        if (capture[0] == CAPTURE_UPVALUE && capture[1] == upvalue) {
+          capture[0] = CAPTURE_VALUE;
+          copyUpvalue(inner, i);
+        }
+      }
+    }
+  }
+}
+
+// A captured local that is never assigned holds the same value for as
+// long as the closures capturing it live. They can copy the value when
+// they are created, so no ObjUpvalue has to be made and closed for it.
+// Decided when the local goes out of scope.
+static void captureByValue(Local* local, int slot) {
+  if (local->captures == 0 || local->assigned) return;
+
+  // The slot may have held other locals before this one was declared.
+  Chunk* chunk = currentChunk();
+  for (int offset = local->start; offset < chunk->count;
+       offset = nextInstruction(chunk, offset)) {
+    if (chunk->code[offset] != OP_CLOSURE) continue;
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    for (int i = 0; i < function->upvalueCount; i++) {
+      uint8_t* capture = &chunk->code[offset + 2 + 2 * i];
+      if (capture[0] == CAPTURE_LOCAL && capture[1] == slot) {
+        capture[0] = CAPTURE_LOCAL_VALUE;
+        copyUpvalue(function, i);
+        local->captures--;
+      }
+    }
+  }
+}
+
+// What can be decided about a local once all its uses have been seen.
+static void endLocal(int slot) {
+  endLocalFunction(&current->locals[slot]);
+  captureByValue(&current->locals[slot], slot);
+}
+
 static ObjFunction* endCompiler() {
-  if (!current->returnStmt) emitReturn();
+  if (!parser.hadError) {
+    for (int i = current->localCount - 1; i > 0; i--) {
+      endLocal(i);
+    }
+  }
 
-  FREE_ARRAY(Local, current->locals, current->localCapacity);
+  // Also after a return statement: it may be in a branch that is not
+  // taken. The optimizer drops the return when it is unreachable.
+  emitReturn();
+  if (optimizeCode && !parser.hadError) optimizeChunk(currentChunk());
 
   ObjFunction* function = current->function;
 #ifdef DEBUG_PRINT_CODE
@@ -251,6 +450,10 @@ static void varDeclaration();
 static void whileStatement();
 static void forStatement();
 static ParseRule* getRule(TokenType type);
+static int resolveUpvalue(Compiler* compiler, Token* name);
+static void markAssigned(Compiler* compiler, int upvalue);
+static void namedVariable(Token name, bool canAssign);
+static void variable(bool canAssign);
 /* static void parsePrecedence(Precedence precedence); */
 
 static void beginScope() {
@@ -262,10 +465,11 @@ static void endScope() {
 
   while(current->localCount > 0 &&
       current->locals[current->localCount - 1].depth > current->scopeDepth) {
+    endLocal(current->localCount - 1);
     Local local = current->locals[current->localCount - 1];
     /* printf("name: %.*s, ", local.name.length, local.name.start); */
-    /* printf("captured: %d\n", local.isCaptured); */
-    if (local.isCaptured) {
+    /* printf("captures: %d\n", local.captures); */
+    if (local.captures > 0) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
       emitByte(OP_POP);
@@ -312,6 +516,11 @@ static void binary(bool canAssign) {
     case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
     case TOKEN_LESS: emitByte(OP_LESS); break;
     case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
+    case TOKEN_AMPERSAND: emitByte(OP_BIT_AND); break;
+    case TOKEN_PIPE: emitByte(OP_BIT_OR); break;
+    case TOKEN_CARET: emitByte(OP_BIT_XOR); break;
+    case TOKEN_LESS_LESS: emitByte(OP_SHIFT_LEFT); break;
+    case TOKEN_GREATER_GREATER: emitByte(OP_SHIFT_RIGHT); break;
     default: return; // Unreachable.
   }
 }
@@ -328,7 +537,7 @@ static void addLocal(Token name, bool init) {
   if (current->localCapacity < current->localCount + 1) {
     int oldCapacity = current->localCapacity;
     current->localCapacity = GROW_CAPACITY(oldCapacity);
-    current->locals = GROW_ARRAY(Local, current->locals,
+    current->locals = ARENA_GROW_ARRAY(&arena, Local, current->locals,
       oldCapacity, current->localCapacity);
   }
 
@@ -344,9 +553,15 @@ static void addLocal(Token name, bool init) {
   }
 
   local->isCaptured = false;
+  local->captures = 0;
+  local->reads = 0;
+  local->closure = -1;
+  local->assigned = false;
+  local->start = currentChunk()->count;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+// Compiles into function, or into a new one when it is NULL.
+static void initCompiler(Compiler* compiler, FunctionType type, ObjFunction* function) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
@@ -355,21 +570,30 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->localCount = 0;
   compiler->localCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
 
-  compiler->breakJump = -1;
+  compiler->breakJumps = NULL;
   compiler->inLoop = false;
-  compiler->returnStmt = false;
+  compiler->lazy = NULL;
+  compiler->globalEnd = -1;
+  compiler->localEnd = -1;
 
-  compiler->function = newFunction();
+  compiler->function = function != NULL ? function : newFunction();
 
   current = compiler;
 
-  if (type != TYPE_SCRIPT) {
+  if (type != TYPE_SCRIPT && function == NULL) {
     current->function->name = copyString(parser.previous.start, parser.previous.length);
   }
 
-  Token tmpToken = {TOKEN_ERROR, "", 0, 0};
+  Token tmpToken = {.type = TOKEN_ERROR, .start = "", .length = 0, .line = 0};
   addLocal(tmpToken, true);
+  // A method gets the receiver in slot 0.
+  if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+    current->locals[0].name.start = "this";
+    current->locals[0].name.length = 4;
+  }
 }
 
 static void printStatement() {
@@ -411,17 +635,19 @@ static void ifStatement() {
 static LoopAttrs startLoop() {
   LoopAttrs prevInLoop;
   prevInLoop.inLoop = current->inLoop;
-  prevInLoop.breakJump = current->breakJump;
+  prevInLoop.breakJumps = current->breakJumps;
 
   current->inLoop = true;
-  current->breakJump = -1;
+  current->breakJumps = NULL;
   return prevInLoop;
 }
 
 static void endLoop(LoopAttrs prevInLoop) {
-  if (current->breakJump != -1) patchJump(current->breakJump);
+  for (BreakJump* jump = current->breakJumps; jump != NULL; jump = jump->next) {
+    patchJump(jump->offset);
+  }
   current->inLoop = prevInLoop.inLoop;
-  current->breakJump = prevInLoop.breakJump;
+  current->breakJumps = prevInLoop.breakJumps;
 }
 
 static void whileStatement() {
@@ -497,7 +723,10 @@ static void forStatement() {
 
 static void breakStatement() {
   if (current->inLoop) {
-    current->breakJump = emitJump(OP_JUMP);
+    BreakJump* jump = ARENA_ALLOCATE(&arena, BreakJump, 1);
+    jump->offset = emitJump(OP_JUMP);
+    jump->next = current->breakJumps;
+    current->breakJumps = jump;
   } else {
     error("'break' outside a loop.");
   }
@@ -508,11 +737,13 @@ static void returnStatement() {
   if (current->type == TYPE_SCRIPT) {
     error("Can't return from top-level code.");
   }
-  current->returnStmt = true;
 
   if (match(TOKEN_SEMICOLON)) {
     emitReturn();
   } else {
+    if (current->type == TYPE_INITIALIZER) {
+      error("Can't return a value from an initializer.");
+    }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return statement.");
     emitByte(OP_RETURN);
@@ -597,17 +828,15 @@ static void varDeclaration() {
   defineVariable(global);
 }
 
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
+static void functionBody() {
   beginScope();
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
   if (!check(TOKEN_RIGHT_PAREN)) {
     do {
-      compiler.function->arity++;
-      if (compiler.function->arity > 255) {
+      current->function->arity++;
+      if (current->function->arity > 255) {
         errorAtCurrent("Function can have max 255 parameters.");
       }
 
@@ -620,25 +849,406 @@ static void function(FunctionType type) {
   consume(TOKEN_LEFT_BRACE, "Expect '{' after closing ')'.");
 
   block();
+}
+
+typedef struct {
+  char* chars;
+  int count;
+  int capacity;
+  int line;
+} TokenText;
+
+// Appends the token, on the same line as in the script, and returns where
+// it starts. Comments and indentation are dropped.
+static int appendToken(TokenText* text, Token* token) {
+  int firstLine = token->line;
+  for (int i = 0; i < token->length; i++) {
+    if (token->start[i] == '\n') firstLine--;
+  }
 
-  ObjFunction* func = endCompiler();
+  int breaks = text->count == 0 ? 0 : firstLine - text->line;
+  int needed = text->count + (breaks > 0 ? breaks : 1) + token->length;
+  if (text->capacity < needed) {
+    int oldCapacity = text->capacity;
+    text->capacity = GROW_CAPACITY(needed);
+    text->chars = ARENA_GROW_ARRAY(&arena, char, text->chars, oldCapacity, text->capacity);
+  }
+
+  if (breaks > 0) {
+    memset(text->chars + text->count, '\n', breaks);
+    text->count += breaks;
+  } else if (text->count > 0) {
+    text->chars[text->count++] = ' ';
+  }
+
+  int start = text->count;
+  memcpy(text->chars + start, token->start, token->length);
+  text->count += token->length;
+  text->line = token->line;
+  return start;
+}
+
+static Token syntheticToken(const char* text) {
+  Token token = {
+    .type = TOKEN_IDENTIFIER,
+    .start = text,
+    .length = (int)strlen(text),
+    .line = parser.previous.line,
+  };
+  return token;
+}
+
+// Captures the variable if it belongs to an enclosing function, for
+// skimFunction(). A start of -1 marks the implicit this of a super call,
+// which has no token in the saved text.
+static void skimCapture(LazyCapture** captures, Token* name, int start) {
+  int upvalueCount = current->function->upvalueCount;
+  int upvalue = resolveUpvalue(current, name);
+  // Whether the body assigns it is only known once it is compiled.
+  if (upvalue != -1) markAssigned(current, upvalue);
+  if (upvalue == upvalueCount) {
+    *captures = ARENA_GROW_ARRAY(&arena, LazyCapture, *captures,
+        upvalueCount, upvalueCount + 1);
+    (*captures)[upvalueCount].start = start;
+    (*captures)[upvalueCount].length = name->length;
+  }
+}
+
+static bool checkThis() {
+  if (currentClass == NULL) {
+    error("Can't use 'this' outside of a class.");
+    return false;
+  }
+  return true;
+}
+
+static bool checkSuper() {
+  if (currentClass == NULL) {
+    error("Can't use 'super' outside of a class.");
+    return false;
+  }
+  if (!currentClass->hasSuperclass) {
+    error("Can't use 'super' in a class with no superclass.");
+    return false;
+  }
+  return true;
+}
+
+// Saves the parameters and body of a function for compileLazy() without
+// compiling them. Every identifier in the body that resolves to a variable
+// of an enclosing function becomes an upvalue, just as if the body had
+// been compiled, so the closure captures it. One that turns out to be
+// shadowed inside the body is captured for nothing, which is harmless.
+static void skimFunction() {
+  TokenText text = {NULL, 0, 0, parser.current.line};
+  int line = parser.current.line;
+  LazyCapture* captures = NULL;
+  int depth = 0;
+
+  if (!check(TOKEN_LEFT_PAREN)) {
+    errorAtCurrent("Expect '(' after function name.");
+    return;
+  }
+
+  for (;;) {
+    if (check(TOKEN_EOF)) {
+      errorAtCurrent("Expect '}' after function body.");
+      return;
+    }
+
+    Token token = parser.current;
+    int start = appendToken(&text, &token);
+
+    bool afterDot = parser.previous.type == TOKEN_DOT;
+    advance();
+    if (token.type == TOKEN_IDENTIFIER && !afterDot) {
+      skimCapture(&captures, &token, start);
+    } else if (token.type == TOKEN_THIS && checkThis()) {
+      skimCapture(&captures, &token, start);
+    } else if (token.type == TOKEN_SUPER && checkSuper()) {
+      skimCapture(&captures, &token, start);
+      Token receiver = syntheticToken("this");
+      skimCapture(&captures, &receiver, -1);
+    }
+
+    if (token.type == TOKEN_LEFT_BRACE) {
+      depth++;
+    } else if (token.type == TOKEN_RIGHT_BRACE && --depth == 0) {
+      break;
+    }
+  }
+
+  LazyBody* lazy = ALLOCATE(LazyBody, 1);
+  lazy->source = NULL;
+  lazy->captures = NULL;
+  lazy->type = current->type;
+  lazy->inClass = currentClass != NULL;
+  lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+  current->function->lazy = lazy;
+
+  int captureCount = current->function->upvalueCount;
+  lazy->source = ALLOCATE(char, text.count);
+  memcpy(lazy->source, text.chars, text.count);
+  lazy->length = text.count;
+  lazy->line = line;
+  lazy->captures = ALLOCATE(LazyCapture, captureCount);
+  if (captureCount > 0) {
+    memcpy(lazy->captures, captures, sizeof(LazyCapture) * captureCount);
+  }
+}
+
+static ObjFunction* function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type, NULL);
+
+  ObjFunction* func;
+  if (lazyCompilation) {
+    skimFunction();
+    func = current->function;
+    current = current->enclosing;
+  } else {
+    functionBody();
+    func = endCompiler();
+  }
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(func)));
 
   for (int i = 0; i < func->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+    emitByte(compiler.upvalues[i].isLocal ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
     emitByte(compiler.upvalues[i].index);
   }
+  return func;
+}
+
+// Bodies up to this many bytes are inlined.
+#define INLINE_MAX_SIZE 32
+
+static bool hasOperand(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CALL:
+    case OP_LIST:
+    case OP_MAP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static int stackEffect(uint8_t op, uint8_t operand) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+      return 1;
+    case OP_CALL:
+      return -operand;
+    case OP_LIST:
+      return 1 - operand;
+    case OP_MAP:
+      return 1 - 2 * operand;
+    case OP_INDEX_SET:
+      return -2;
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_BIT_NOT:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+// A function can be inlined when its body is a short straight line of
+// instructions that ends in a return and only uses its own stack window:
+// no jumps, closures or upvalues.
+static bool canInline(ObjFunction* function, Inline* candidate) {
+  Chunk* chunk = &function->chunk;
+  if (function->upvalueCount > 0 || function->lazy != NULL) return false;
+
+  int height = function->arity + 1;
+  candidate->constants = 0;
+  for (int offset = 0; offset < chunk->count && offset < INLINE_MAX_SIZE;) {
+    uint8_t op = chunk->code[offset];
+    switch (op) {
+      case OP_RETURN:
+        return true;
+      case OP_CONSTANT:
+        // A local function reading this frame, see endLocalFunction().
+        if (IS_CLOSURE(chunk->constants.values[chunk->code[offset + 1]])) return false;
+        candidate->constants++;
+        break;
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+        candidate->constants++;
+        break;
+      case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_NOT: case OP_EQUAL:
+      case OP_GREATER: case OP_LESS: case OP_ADD: case OP_SUBTRACT:
+      case OP_MULTIPLY: case OP_DIVIDE: case OP_NEGATE: case OP_PRINT:
+      case OP_POP: case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_CALL:
+      case OP_BIT_AND: case OP_BIT_OR: case OP_BIT_XOR: case OP_BIT_NOT:
+      case OP_SHIFT_LEFT: case OP_SHIFT_RIGHT: case OP_LIST:
+      case OP_INDEX_GET: case OP_INDEX_SET: case OP_MAP:
+        break;
+      default:
+        return false;
+    }
+
+    height += stackEffect(op, hasOperand(op) ? chunk->code[offset + 1] : 0);
+    if (height > UINT8_MAX) return false;
+    offset += hasOperand(op) ? 2 : 1;
+  }
+  return false;
+}
+
+static void addInline(ObjString* name, ObjFunction* function) {
+  Inline candidate;
+  if (!canInline(function, &candidate)) return;
+  candidate.name = name;
+  candidate.function = function;
+
+  if (inlines.capacity < inlines.count + 1) {
+    int oldCapacity = inlines.capacity;
+    inlines.capacity = GROW_CAPACITY(oldCapacity);
+    inlines.functions = ARENA_GROW_ARRAY(&arena, Inline, inlines.functions,
+        oldCapacity, inlines.capacity);
+  }
+  inlines.functions[inlines.count++] = candidate;
+}
+
+// The latest declaration wins, like it does at runtime.
+static Inline* findInline(ObjString* name) {
+  for (int i = inlines.count - 1; i >= 0; i--) {
+    if (inlines.functions[i].name == name) return &inlines.functions[i];
+  }
+  return NULL;
+}
+
+// Copies the body of the callee in place of the call. Its slots are
+// addressed from the top of the stack, since the compiler does not know
+// how deep the stack is here, and the return leaves the result where the
+// callee was. OP_CHECK_CALLEE makes the global that was called still hold
+// the inlined function, otherwise the call is made after all. The body
+// keeps the lines of the callee in an InlineSite, so a runtime error in
+// it still shows the callee in the stack trace.
+static void inlineCall(Inline* callee, uint8_t argCount) {
+  Chunk* chunk = &callee->function->chunk;
+  uint8_t constant = makeConstant(OBJ_VAL(callee->function));
+  emitBytes(OP_CHECK_CALLEE, argCount);
+  emitBytes(constant, 0xff);
+  emitByte(0xff);
+  int slowJump = currentChunk()->count - 2;
+
+  int site = addInlineSite(currentChunk(), constant);
+  int height = argCount + 1;
+  for (int offset = 0; chunk->code[offset] != OP_RETURN;) {
+    uint8_t op = chunk->code[offset];
+    uint8_t operand = hasOperand(op) ? chunk->code[offset + 1] : 0;
+    markInlined(currentChunk(), site, getLine(chunk, offset));
+    switch (op) {
+      case OP_CONSTANT:
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+        emitBytes(op, makeConstant(chunk->constants.values[operand]));
+        break;
+      case OP_GET_LOCAL: emitBytes(OP_PEEK, height - 1 - operand); break;
+      case OP_SET_LOCAL: emitBytes(OP_POKE, height - 1 - operand); break;
+      case OP_CALL:
+      case OP_LIST:
+      case OP_MAP: emitBytes(op, operand); break;
+      default: emitByte(op); break;
+    }
+    height += stackEffect(op, operand);
+    offset += hasOperand(op) ? 2 : 1;
+  }
+  endInlined(currentChunk(), site);
+  emitBytes(OP_SLIDE, height - 1);
+
+  int endJump = emitJump(OP_JUMP);
+  patchJump(slowJump);
+  emitBytes(OP_CALL, argCount);
+  patchJump(endJump);
 }
 
 static void funDeclaration() {
   uint8_t global = parseVariable("Missing function name.");
   markInitialized();
-  function(TYPE_FUNCTION);
+  if (current->scopeDepth > 0) {
+    current->locals[current->localCount - 1].closure = currentChunk()->count;
+  }
+  ObjFunction* func = function(TYPE_FUNCTION);
+  if (optimizeCode && current->type == TYPE_SCRIPT && current->scopeDepth == 0) {
+    addInline(AS_STRING(currentChunk()->constants.values[global]), func);
+  }
   defineVariable(global);
 }
 
+static void method() {
+  consume(TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifierConstant(&parser.previous);
+  FunctionType type = TYPE_METHOD;
+  if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
+  }
+  function(type);
+  emitBytes(OP_METHOD, constant);
+}
+
+// The superclass is kept in a local named super around the methods,
+// which capture it like any other variable.
+static void classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser.previous;
+  uint8_t nameConstant = identifierConstant(&parser.previous);
+  declareVariable();
+
+  emitBytes(OP_CLASS, nameConstant);
+  defineVariable(nameConstant);
+
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = currentClass;
+  classCompiler.hasSuperclass = false;
+  currentClass = &classCompiler;
+
+  if (match(TOKEN_LESS)) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(false);
+    if (identifiersEqual(&className, &parser.previous)) {
+      error("A class can't inherit from itself.");
+    }
+
+    beginScope();
+    addLocal(syntheticToken("super"), false);
+    defineVariable(0);
+
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  namedVariable(className, false);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    method();
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(OP_POP);
+
+  if (classCompiler.hasSuperclass) endScope();
+  currentClass = currentClass->enclosing;
+}
+
 static void declaration() {
-  if (match(TOKEN_VAR)) {
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_VAR)) {
     varDeclaration();
   } else if (match(TOKEN_FUN)) {
     funDeclaration();
@@ -654,8 +1264,11 @@ static void expression() {
 }
 
 static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+  emitConstant(NUMBER_VAL(parser.previous.number));
+}
+
+static void integer(bool canAssign) {
+  emitConstant(INT_VAL(parser.previous.integer));
 }
 
 static void string(bool canAssign) {
@@ -685,6 +1298,7 @@ static void unary(bool canAssign) {
   switch(type) {
     case TOKEN_MINUS: emitByte(OP_NEGATE); break;
     case TOKEN_BANG: emitByte(OP_NOT); break;
+    case TOKEN_TILDE: emitByte(OP_BIT_NOT); break;
     default: return;
   }
 }
@@ -717,19 +1331,45 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
     return 0;
   }
 
+  if (compiler->upvalueCapacity < upvalueCount + 1) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = ARENA_GROW_ARRAY(&arena, Upvalue, compiler->upvalues,
+      oldCapacity, compiler->upvalueCapacity);
+  }
+
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
 
   return compiler->function->upvalueCount++;
 }
 
+// The upvalues of a lazily compiled function were found by skimFunction().
+static int resolveCapture(Compiler* compiler, Token* name) {
+  if (compiler->lazy == NULL) return -1;
+
+  for (int i = 0; i < compiler->function->upvalueCount; i++) {
+    LazyCapture* capture = &compiler->lazy->captures[i];
+    const char* chars = capture->start == -1 ? "this" : compiler->lazy->source + capture->start;
+    if (capture->length == name->length && memcmp(chars, name->start, name->length) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
 static int resolveUpvalue(Compiler* compiler, Token* name) {
-  if (compiler->enclosing == NULL) return -1;
+  if (compiler->enclosing == NULL) return resolveCapture(compiler, name);
 
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
+    int upvalueCount = compiler->function->upvalueCount;
+    int upvalue = addUpvalue(compiler, (uint8_t)local, true);
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    if (compiler->function->upvalueCount > upvalueCount) {
+      compiler->enclosing->locals[local].captures++;
+    }
+    return upvalue;
   }
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
@@ -740,6 +1380,19 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
   return -1;
 }
 
+// Marks the local that the upvalue refers to in the end.
+static void markAssigned(Compiler* compiler, int upvalue) {
+  while (compiler->enclosing != NULL) {
+    Upvalue* captured = &compiler->upvalues[upvalue];
+    if (captured->isLocal) {
+      compiler->enclosing->locals[captured->index].assigned = true;
+      return;
+    }
+    upvalue = captured->index;
+    compiler = compiler->enclosing;
+  }
+}
+
 static void namedVariable(Token name, bool canAssign) {
   uint8_t setOp, getOp;
   int arg = resolveLocal(current, &name);
@@ -759,8 +1412,15 @@ static void namedVariable(Token name, bool canAssign) {
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitBytes(setOp, arg);
+    if (setOp == OP_SET_LOCAL) current->locals[arg].assigned = true;
+    if (setOp == OP_SET_UPVALUE) markAssigned(current, arg);
   } else {
     emitBytes(getOp, arg);
+    if (getOp == OP_GET_GLOBAL) current->globalEnd = currentChunk()->count;
+    if (getOp == OP_GET_LOCAL) {
+      current->locals[arg].reads++;
+      current->localEnd = currentChunk()->count;
+    }
   }
 }
 
@@ -779,14 +1439,114 @@ static uint8_t argumentList() {
 }
 
 static void call(bool canAssign) {
+  // Calling a local is not a read that lets its value escape.
+  if (current->localEnd == currentChunk()->count) {
+    current->locals[currentChunk()->code[currentChunk()->count - 1]].reads--;
+  }
+
+  Inline* callee = NULL;
+  if (optimizeCode && current->globalEnd == currentChunk()->count) {
+    Chunk* chunk = currentChunk();
+    callee = findInline(AS_STRING(chunk->constants.values[chunk->code[chunk->count - 1]]));
+  }
+
   uint8_t argCount = argumentList();
+  if (callee != NULL && callee->function->arity == argCount &&
+      currentChunk()->constants.count + callee->constants < UINT8_COUNT) {
+    if (inlineReport) {
+      fprintf(vm.err, "[inline] line %d: %s()\n", parser.previous.line,
+          callee->function->name->chars);
+    }
+    inlineCall(callee, argCount);
+    return;
+  }
   emitBytes(OP_CALL, argCount);
 }
 
+static void list(bool canAssign) {
+  int count = 0;
+  while (!check(TOKEN_RIGHT_BRACKET)) {
+    expression();
+    if (count == UINT8_MAX) {
+      error("Can't have more than 255 elements in a list literal.");
+    }
+    count++;
+    if (!match(TOKEN_COMMA)) break;
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  emitBytes(OP_LIST, count);
+}
+
+static void map(bool canAssign) {
+  int count = 0;
+  while (!check(TOKEN_RIGHT_BRACE)) {
+    expression();
+    consume(TOKEN_COLON, "Expect ':' after map key.");
+    expression();
+    if (count == UINT8_MAX) {
+      error("Can't have more than 255 entries in a map literal.");
+    }
+    count++;
+    if (!match(TOKEN_COMMA)) break;
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitBytes(OP_MAP, count);
+}
+
+static void index_(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_INDEX_SET);
+  } else {
+    emitByte(OP_INDEX_GET);
+  }
+}
+
 static void variable(bool canAssign) {
   namedVariable(parser.previous, canAssign);
 }
 
+static void dot(bool canAssign) {
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitProperty(OP_SET_PROPERTY, name);
+  } else if (match(TOKEN_LEFT_PAREN)) {
+    // A method call without a bound method in between.
+    uint8_t argCount = argumentList();
+    emitInvoke(OP_INVOKE, name, argCount);
+  } else {
+    emitProperty(OP_GET_PROPERTY, name);
+  }
+}
+
+static void this_(bool canAssign) {
+  if (!checkThis()) return;
+  variable(false);
+}
+
+static void super_(bool canAssign) {
+  checkSuper();
+  consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = identifierConstant(&parser.previous);
+
+  namedVariable(syntheticToken("this"), false);
+  if (match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList();
+    namedVariable(syntheticToken("super"), false);
+    emitInvoke(OP_SUPER_INVOKE, name, argCount);
+  } else {
+    namedVariable(syntheticToken("super"), false);
+    emitBytes(OP_GET_SUPER, name);
+  }
+}
+
 static void and_(bool canAssign) {
   int endJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
@@ -808,15 +1568,22 @@ static void or_(bool canAssign) {
 ParseRule rules[] = {
   [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
   [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
-  [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+  [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
   [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+  [TOKEN_LEFT_BRACKET] = {list, index_, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
+  [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
   [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
-  [TOKEN_DOT] = {NULL, NULL, PREC_NONE},
+  [TOKEN_DOT] = {NULL, dot, PREC_CALL},
   [TOKEN_MINUS] = {unary, binary, PREC_TERM},
   [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
   [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
   [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
   [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+  [TOKEN_AMPERSAND] = {NULL, binary, PREC_BIT_AND},
+  [TOKEN_PIPE] = {NULL, binary, PREC_BIT_OR},
+  [TOKEN_CARET] = {NULL, binary, PREC_BIT_XOR},
+  [TOKEN_TILDE] = {unary, NULL, PREC_NONE},
   [TOKEN_BANG] = {unary, NULL, PREC_NONE},
   [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
   [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
@@ -825,9 +1592,12 @@ ParseRule rules[] = {
   [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
   [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
   [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
+  [TOKEN_LESS_LESS] = {NULL, binary, PREC_SHIFT},
+  [TOKEN_GREATER_GREATER] = {NULL, binary, PREC_SHIFT},
   [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
   [TOKEN_STRING] = {string, NULL, PREC_NONE},
   [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
+  [TOKEN_INTEGER] = {integer, NULL, PREC_NONE},
   [TOKEN_AND] = {NULL, and_, PREC_AND},
   [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
   [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
@@ -839,8 +1609,8 @@ ParseRule rules[] = {
   [TOKEN_OR] = {NULL, or_, PREC_OR},
   [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
   [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
-  [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
-  [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
+  [TOKEN_SUPER] = {super_, NULL, PREC_NONE},
+  [TOKEN_THIS] = {this_, NULL, PREC_NONE},
   [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
   [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
   [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
@@ -852,10 +1622,9 @@ static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
+static ObjFunction* compileScript() {
   Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+  initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
   parser.hadError = false;
   parser.panicMode = false;
@@ -868,9 +1637,82 @@ ObjFunction* compile(const char* source) {
 
   consume(TOKEN_EOF, "Expect end of expression.");
   ObjFunction* function = endCompiler();
+  resetArena(&arena);
+  inlines = (Inlines){NULL, 0, 0};
   return parser.hadError ? NULL : function;
 }
 
+ObjFunction* compile(const char* source, size_t length) {
+  initScanner(source, length);
+  return compileScript();
+}
+
+// Compiles tokens as they arrive, for scripts piped in from another process.
+ObjFunction* compileStream(int fd) {
+  initScannerStream(fd);
+  ObjFunction* function = compileScript();
+  freeScanner();
+  return function;
+}
+
+// Compiles a function saved by skimFunction(). On errors the function
+// stays uncompiled and every call reports them again.
+bool compileLazy(ObjFunction* function) {
+  LazyBody* lazy = function->lazy;
+  initScanner(lazy->source, lazy->length);
+  setScannerLine(lazy->line);
+  parser.hadError = false;
+  parser.panicMode = false;
+
+  Compiler compiler;
+  initCompiler(&compiler, (FunctionType)lazy->type, function);
+  compiler.lazy = lazy;
+  // Only what this and super need to know of the class it was in.
+  ClassCompiler classCompiler = {NULL, lazy->hasSuperclass};
+  ClassCompiler* enclosingClass = currentClass;
+  currentClass = lazy->inClass ? &classCompiler : NULL;
+
+  advance();
+  functionBody();
+  endCompiler();
+  currentClass = enclosingClass;
+  resetArena(&arena);
+
+  if (parser.hadError) {
+    freeChunk(&function->chunk);
+    initChunk(&function->chunk);
+    function->arity = 0;
+    return false;
+  }
+
+  freeLazyBody(function);
+  return true;
+}
+
+void freeLazyBody(ObjFunction* function) {
+  LazyBody* lazy = function->lazy;
+  FREE_ARRAY(char, lazy->source, lazy->length);
+  FREE_ARRAY(LazyCapture, lazy->captures, function->upvalueCount);
+  FREE(LazyBody, lazy);
+  function->lazy = NULL;
+}
+
+void setInlineReport(bool enabled) {
+  inlineReport = enabled;
+}
+
+void setLazyCompilation(bool enabled) {
+  lazyCompilation = enabled;
+}
+
+void setOptimization(bool enabled) {
+  optimizeCode = enabled;
+}
+
+void freeCompiler() {
+  freeArena(&arena);
+}
+
 void markCompilerRoots() {
   Compiler* compiler = current;
   while (compiler != NULL) {
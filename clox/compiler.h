@@ -4,7 +4,14 @@
 #include "chunk.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
+ObjFunction* compile(const char* source, size_t length);
+ObjFunction* compileStream(int fd);
+bool compileLazy(ObjFunction* function);
+void freeLazyBody(ObjFunction* function);
+void setLazyCompilation(bool enabled);
+void setOptimization(bool enabled);
+void setInlineReport(bool enabled);
 void markCompilerRoots();
+void freeCompiler();
 
 #endif
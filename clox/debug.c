@@ -34,6 +34,25 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8 | chunk->code[offset + 3]);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
+static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8 | chunk->code[offset + 4]);
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 5;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
   uint16_t jump = chunk->code[offset + 1] << 8;
   jump |= chunk->code[offset + 2];
@@ -48,7 +67,8 @@ int getLine(Chunk* chunk, int offset) {
       return chunk->lines.lines[i - 1];
     }
   }
-  return -1;
+  // The last run goes on to the end of the chunk.
+  return chunk->lines.count > 0 ? chunk->lines.lines[chunk->lines.count - 1] : -1;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset, int* previousLine) {
@@ -89,7 +109,7 @@ int disassembleInstruction(Chunk* chunk, int offset, int* previousLine) {
         case OP_LOOP:
           return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
-          return simpleInstruction("OP_CALL", offset);
+          return byteInstruction("OP_CALL", chunk, offset);
         case OP_CLOSURE: {
           offset++;
           uint8_t constant = chunk->code[offset++];
@@ -99,11 +119,17 @@ int disassembleInstruction(Chunk* chunk, int offset, int* previousLine) {
 
           ObjFunction* function = AS_FUNCTION(
               chunk->constants.values[constant]);
+          static const char* kinds[] = {
+            [CAPTURE_UPVALUE] = "upvalue",
+            [CAPTURE_LOCAL] = "local",
+            [CAPTURE_VALUE] = "upvalue value",
+            [CAPTURE_LOCAL_VALUE] = "local value",
+          };
           for (int i = 0; i < function->upvalueCount; i++) {
-            uint8_t isLocal = chunk->code[offset++];
+            uint8_t kind = chunk->code[offset++];
             uint8_t index = chunk->code[offset++];
             printf("%04d     |                     %s %d\n",
-offset - 2, isLocal ? "local" : "upvalue", index);
+offset - 2, kinds[kind & 3], index);
           }
 
           return offset;
@@ -114,6 +140,27 @@ offset - 2, isLocal ? "local" : "upvalue", index);
           return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_CLOSE_UPVALUE:
           return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+        case OP_CHECK_CALLEE: {
+          uint8_t argCount = chunk->code[offset + 1];
+          uint8_t constant = chunk->code[offset + 2];
+          uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+          printf("%-16s %4d ", "OP_CHECK_CALLEE", argCount);
+          printValue(chunk->constants.values[constant]);
+          printf(" else -> %d\n", offset + 5 + jump);
+          return offset + 5;
+        }
+        case OP_PEEK:
+          return byteInstruction("OP_PEEK", chunk, offset);
+        case OP_POKE:
+          return byteInstruction("OP_POKE", chunk, offset);
+        case OP_SLIDE:
+          return byteInstruction("OP_SLIDE", chunk, offset);
+        case OP_GET_ENCLOSING:
+          return byteInstruction("OP_GET_ENCLOSING", chunk, offset);
+        case OP_SET_ENCLOSING:
+          return byteInstruction("OP_SET_ENCLOSING", chunk, offset);
+        case OP_GET_CAPTURED:
+          return byteInstruction("OP_GET_CAPTURED", chunk, offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
         case OP_ADD:
@@ -138,6 +185,68 @@ offset - 2, isLocal ? "local" : "upvalue", index);
           return simpleInstruction("OP_GREATER", offset);
         case OP_LESS:
           return simpleInstruction("OP_LESS", offset);
+        case OP_BIT_AND:
+          return simpleInstruction("OP_BIT_AND", offset);
+        case OP_BIT_OR:
+          return simpleInstruction("OP_BIT_OR", offset);
+        case OP_BIT_XOR:
+          return simpleInstruction("OP_BIT_XOR", offset);
+        case OP_BIT_NOT:
+          return simpleInstruction("OP_BIT_NOT", offset);
+        case OP_SHIFT_LEFT:
+          return simpleInstruction("OP_SHIFT_LEFT", offset);
+        case OP_SHIFT_RIGHT:
+          return simpleInstruction("OP_SHIFT_RIGHT", offset);
+        case OP_LIST:
+          return byteInstruction("OP_LIST", chunk, offset);
+        case OP_INDEX_GET:
+          return simpleInstruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:
+          return simpleInstruction("OP_INDEX_SET", offset);
+        case OP_MAP:
+          return byteInstruction("OP_MAP", chunk, offset);
+        case OP_CLASS:
+          return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_INHERIT:
+          return simpleInstruction("OP_INHERIT", offset);
+        case OP_METHOD:
+          return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_GET_PROPERTY:
+          return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY:
+          return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_GET_SUPER:
+          return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_INVOKE:
+          return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_SUPER_INVOKE:
+          return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_ADD_NUM:
+          return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+          return simpleInstruction("OP_ADD_STR", offset);
+        case OP_EQUAL_NUM:
+          return simpleInstruction("OP_EQUAL_NUM", offset);
+        case OP_GREATER_NUM:
+          return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+          return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_SUBTRACT_NUM:
+          return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+          return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_ADD_INT:
+          return simpleInstruction("OP_ADD_INT", offset);
+        case OP_SUBTRACT_INT:
+          return simpleInstruction("OP_SUBTRACT_INT", offset);
+        case OP_MULTIPLY_INT:
+          return simpleInstruction("OP_MULTIPLY_INT", offset);
+        case OP_EQUAL_INT:
+          return simpleInstruction("OP_EQUAL_INT", offset);
+        case OP_GREATER_INT:
+          return simpleInstruction("OP_GREATER_INT", offset);
+        case OP_LESS_INT:
+          return simpleInstruction("OP_LESS_INT", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "vm.h"
+
+// Returns NULL after reporting the problem to vm.err, so that the batch
+// runner can carry on with the other scripts.
+char* readFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(vm.err, "Could not open file \"%s\".\n", path);
+    return NULL;
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t fileSize = ftell(file);
+  rewind(file);
+
+  char* buffer = (char*)malloc(fileSize + 1);
+  if (buffer == NULL) {
+    fprintf(vm.err, "Not enough memory to read \"%s\".\n", path);
+    fclose(file);
+    return NULL;
+  }
+
+  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  if (bytesRead < fileSize) {
+    fprintf(vm.err, "Could not read file \"%s\".\n", path);
+    free(buffer);
+    fclose(file);
+    return NULL;
+  }
+
+  buffer[bytesRead] = '\0';
+
+  fclose(file);
+  return buffer;
+}
+
+// Returns false after reporting the problem to vm.err, like readFile().
+bool openSource(const char* path, Source* source) {
+  source->text = NULL;
+  source->length = 0;
+  source->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  if (source->fd == -1) {
+    fprintf(vm.err, "Could not open file \"%s\".\n", path);
+    return false;
+  }
+
+  // Pipes and terminals are streamed, regular files mapped.
+  struct stat info;
+  int error = fstat(source->fd, &info) == -1 ? errno
+    : S_ISDIR(info.st_mode) ? EISDIR : 0;
+  if (error != 0) {
+    fprintf(vm.err, "Could not read file \"%s\": %s.\n", path, strerror(error));
+    closeSource(source);
+    return false;
+  }
+  if (!S_ISREG(info.st_mode)) return true;
+
+  // mmap() refuses empty files.
+  if (info.st_size == 0) {
+    source->text = "";
+  } else {
+    void* text = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, source->fd, 0);
+    if (text == MAP_FAILED) {
+      fprintf(vm.err, "Could not read file \"%s\".\n", path);
+      closeSource(source);
+      return false;
+    }
+    madvise(text, info.st_size, MADV_SEQUENTIAL);
+    source->text = text;
+    source->length = info.st_size;
+  }
+  return true;
+}
+
+void closeSource(Source* source) {
+  if (source->length > 0) munmap((void*)source->text, source->length);
+  if (source->fd > STDIN_FILENO) close(source->fd);
+  source->text = NULL;
+  source->length = 0;
+  source->fd = -1;
+}
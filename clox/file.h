@@ -0,0 +1,19 @@
+#ifndef clox_file_h
+#define clox_file_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A script to run. Regular files are mapped, anything else, like a pipe
+// or "-" for stdin, is left open for streaming and text is NULL.
+typedef struct {
+  const char* text;
+  size_t length;
+  int fd;
+} Source;
+
+char* readFile(const char* path);
+bool openSource(const char* path, Source* source);
+void closeSource(Source* source);
+
+#endif
@@ -0,0 +1,284 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "floatarray.h"
+#include "memory.h"
+#include "object.h"
+#include "simd.h"
+#include "vm.h"
+
+// The kernels run SIMD_DOUBLES lanes at a time and finish with a scalar
+// tail. Sums keep one accumulator per lane, so they round differently
+// from a loop in Lox adding the elements in order.
+
+#ifdef SIMD_DOUBLES
+static double sumLanes(SimdDoubles values) {
+  double lanes[SIMD_DOUBLES];
+  simdStoreDoubles(lanes, values);
+  double sum = 0;
+  for (int i = 0; i < SIMD_DOUBLES; i++) sum += lanes[i];
+  return sum;
+}
+#endif
+
+static double sumKernel(const double* a, int count) {
+  double sum = 0;
+  int i = 0;
+#ifdef SIMD_DOUBLES
+  SimdDoubles first = simdSplat(0);
+  SimdDoubles second = simdSplat(0);
+  for (; i + 2 * SIMD_DOUBLES <= count; i += 2 * SIMD_DOUBLES) {
+    first = simdAdd(first, simdLoadDoubles(a + i));
+    second = simdAdd(second, simdLoadDoubles(a + i + SIMD_DOUBLES));
+  }
+  sum = sumLanes(simdAdd(first, second));
+#endif
+  for (; i < count; i++) sum += a[i];
+  return sum;
+}
+
+static double dotKernel(const double* a, const double* b, int count) {
+  double sum = 0;
+  int i = 0;
+#ifdef SIMD_DOUBLES
+  SimdDoubles first = simdSplat(0);
+  SimdDoubles second = simdSplat(0);
+  for (; i + 2 * SIMD_DOUBLES <= count; i += 2 * SIMD_DOUBLES) {
+    first = simdAdd(first, simdMul(simdLoadDoubles(a + i), simdLoadDoubles(b + i)));
+    second = simdAdd(second, simdMul(simdLoadDoubles(a + i + SIMD_DOUBLES),
+                                     simdLoadDoubles(b + i + SIMD_DOUBLES)));
+  }
+  sum = sumLanes(simdAdd(first, second));
+#endif
+  for (; i < count; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+static void scaleKernel(double* a, double factor, int count) {
+  int i = 0;
+#ifdef SIMD_DOUBLES
+  SimdDoubles splat = simdSplat(factor);
+  for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+    simdStoreDoubles(a + i, simdMul(simdLoadDoubles(a + i), splat));
+  }
+#endif
+  for (; i < count; i++) a[i] *= factor;
+}
+
+static void addKernel(double* a, const double* b, int count) {
+  int i = 0;
+#ifdef SIMD_DOUBLES
+  for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+    simdStoreDoubles(a + i, simdAdd(simdLoadDoubles(a + i), simdLoadDoubles(b + i)));
+  }
+#endif
+  for (; i < count; i++) a[i] += b[i];
+}
+
+static void fillKernel(double* a, double value, int count) {
+  int i = 0;
+#ifdef SIMD_DOUBLES
+  SimdDoubles splat = simdSplat(value);
+  for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+    simdStoreDoubles(a + i, splat);
+  }
+#endif
+  for (; i < count; i++) a[i] = value;
+}
+
+// The smallest element, or the largest when max is set. count > 0. NaNs
+// are skipped like fmin() and fmax() skip them, and only an array of
+// NaNs gives NaN. Each lane starts from the first number, and the array
+// is the first operand of minpd/maxpd, which return the second one when
+// either is NaN, so a NaN never gets into a lane.
+static double extremeKernel(const double* a, int count, bool max) {
+  int first = 0;
+  while (first < count && a[first] != a[first]) first++;
+  if (first == count) return a[0];
+
+  double result = a[first];
+  int i = first + 1;
+#ifdef SIMD_DOUBLES
+  if (count - i >= SIMD_DOUBLES) {
+    SimdDoubles extreme = simdSplat(result);
+    for (; i + SIMD_DOUBLES <= count; i += SIMD_DOUBLES) {
+      SimdDoubles values = simdLoadDoubles(a + i);
+      extreme = max ? simdMax(values, extreme) : simdMin(values, extreme);
+    }
+    double lanes[SIMD_DOUBLES];
+    simdStoreDoubles(lanes, extreme);
+    for (int lane = 0; lane < SIMD_DOUBLES; lane++) {
+      if (max ? lanes[lane] > result : lanes[lane] < result) result = lanes[lane];
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    if (max ? a[i] > result : a[i] < result) result = a[i];
+  }
+  return result;
+}
+
+static bool floatArrayArg(Value value, const char* name, ObjFloatArray** array) {
+  if (!IS_FLOAT_ARRAY(value)) {
+    runtimeError("%s() takes a float array.", name);
+    return false;
+  }
+  *array = AS_FLOAT_ARRAY(value);
+  return true;
+}
+
+static bool numberArg(Value value, const char* name, double* number) {
+  if (!IS_NUMERIC(value)) {
+    runtimeError("%s() takes a number.", name);
+    return false;
+  }
+  *number = AS_FLOAT(value);
+  return true;
+}
+
+static bool sameLength(ObjFloatArray* a, ObjFloatArray* b, const char* name) {
+  if (a->count != b->count) {
+    runtimeError("%s() got float arrays of length %d and %d.", name, a->count, b->count);
+    return false;
+  }
+  return true;
+}
+
+// floatArray(count) is zeroed, floatArray(list) copies a list of numbers.
+static bool floatArrayNative(int argCount, Value* args, Value* result) {
+  if (IS_INT(args[0])) {
+    int64_t count = AS_INT(args[0]);
+    if (count < 0 || count > INT32_MAX) {
+      runtimeError("Invalid float array length %" PRId64 ".", count);
+      return false;
+    }
+    *result = OBJ_VAL(newFloatArray((int)count));
+    return true;
+  }
+
+  if (!IS_LIST(args[0])) {
+    runtimeError("floatArray() takes a length or a list.");
+    return false;
+  }
+  ValueArray* items = &AS_LIST(args[0])->items;
+  for (int i = 0; i < items->count; i++) {
+    if (!IS_NUMERIC(items->values[i])) {
+      runtimeError("floatArray() takes a list of numbers.");
+      return false;
+    }
+  }
+  ObjFloatArray* array = newFloatArray(items->count);
+  for (int i = 0; i < items->count; i++) {
+    array->values[i] = AS_FLOAT(items->values[i]);
+  }
+  *result = OBJ_VAL(array);
+  return true;
+}
+
+static bool sumNative(int argCount, Value* args, Value* result) {
+  ObjFloatArray* a;
+  if (!floatArrayArg(args[0], "sum", &a)) return false;
+  *result = NUMBER_VAL(sumKernel(a->values, a->count));
+  return true;
+}
+
+static bool dotNative(int argCount, Value* args, Value* result) {
+  ObjFloatArray* a;
+  ObjFloatArray* b;
+  if (!floatArrayArg(args[0], "dot", &a) || !floatArrayArg(args[1], "dot", &b) ||
+      !sameLength(a, b, "dot")) {
+    return false;
+  }
+  *result = NUMBER_VAL(dotKernel(a->values, b->values, a->count));
+  return true;
+}
+
+// scale(), add() and fill() change the array and return it.
+static bool scaleNative(int argCount, Value* args, Value* result) {
+  ObjFloatArray* a;
+  double factor;
+  if (!floatArrayArg(args[0], "scale", &a) || !numberArg(args[1], "scale", &factor)) {
+    return false;
+  }
+  scaleKernel(a->values, factor, a->count);
+  *result = args[0];
+  return true;
+}
+
+static bool addNative(int argCount, Value* args, Value* result) {
+  ObjFloatArray* a;
+  ObjFloatArray* b;
+  if (!floatArrayArg(args[0], "add", &a) || !floatArrayArg(args[1], "add", &b) ||
+      !sameLength(a, b, "add")) {
+    return false;
+  }
+  addKernel(a->values, b->values, a->count);
+  *result = args[0];
+  return true;
+}
+
+static bool fillNative(int argCount, Value* args, Value* result) {
+  ObjFloatArray* a;
+  double value;
+  if (!floatArrayArg(args[0], "fill", &a) || !numberArg(args[1], "fill", &value)) {
+    return false;
+  }
+  fillKernel(a->values, value, a->count);
+  *result = args[0];
+  return true;
+}
+
+static bool extremeNative(Value* args, Value* result, bool max) {
+  const char* name = max ? "max" : "min";
+  ObjFloatArray* a;
+  if (!floatArrayArg(args[0], name, &a)) return false;
+  if (a->count == 0) {
+    runtimeError("%s() of an empty float array.", name);
+    return false;
+  }
+  *result = NUMBER_VAL(extremeKernel(a->values, a->count, max));
+  return true;
+}
+
+static bool minNative(int argCount, Value* args, Value* result) {
+  return extremeNative(args, result, false);
+}
+
+static bool maxNative(int argCount, Value* args, Value* result) {
+  return extremeNative(args, result, true);
+}
+
+// slice(a, start, end) copies the elements from start up to end.
+static bool sliceNative(int argCount, Value* args, Value* result) {
+  ObjFloatArray* a;
+  if (!floatArrayArg(args[0], "slice", &a)) return false;
+  if (!IS_INT(args[1]) || !IS_INT(args[2])) {
+    runtimeError("slice() takes integer bounds.");
+    return false;
+  }
+  int64_t start = AS_INT(args[1]);
+  int64_t end = AS_INT(args[2]);
+  if (start < 0 || start > end || end > a->count) {
+    runtimeError("slice() range %" PRId64 "..%" PRId64 " out of 0..%d.", start, end, a->count);
+    return false;
+  }
+
+  ObjFloatArray* slice = newFloatArray((int)(end - start));
+  if (end > start) {
+    memcpy(slice->values, a->values + start, sizeof(double) * (end - start));
+  }
+  *result = OBJ_VAL(slice);
+  return true;
+}
+
+void defineFloatArrayNatives() {
+  defineNative("floatArray", floatArrayNative, 1);
+  defineNative("sum", sumNative, 1);
+  defineNative("dot", dotNative, 2);
+  defineNative("scale", scaleNative, 2);
+  defineNative("add", addNative, 2);
+  defineNative("min", minNative, 1);
+  defineNative("max", maxNative, 1);
+  defineNative("fill", fillNative, 2);
+  defineNative("slice", sliceNative, 3);
+}
@@ -0,0 +1,6 @@
+#ifndef clox_floatarray_h
+#define clox_floatarray_h
+
+void defineFloatArrayNatives();
+
+#endif
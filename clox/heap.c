@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
+
+// One class per granule up to 256 bytes, then four per power of two.
+#define HEAP_SMALL_CLASSES (256 / HEAP_GRANULE)
+
+static int sizeClassOf(size_t size) {
+  if (size <= 256) return (int)((size + HEAP_GRANULE - 1) >> HEAP_GRANULE_SHIFT) - 1;
+
+  int shift = 63 - __builtin_clzll(size - 1);
+  return HEAP_SMALL_CLASSES + (shift - 8) * 4 + (int)((size - 1) >> (shift - 2)) - 4;
+}
+
+static size_t classSize(int sizeClass) {
+  if (sizeClass < HEAP_SMALL_CLASSES) return (size_t)(sizeClass + 1) * HEAP_GRANULE;
+
+  int shift = (sizeClass - HEAP_SMALL_CLASSES) / 4;
+  int step = (sizeClass - HEAP_SMALL_CLASSES) % 4;
+  return ((size_t)256 << shift) + (size_t)(step + 1) * ((size_t)64 << shift);
+}
+
+static void setBit(uint64_t* bits, size_t granule) {
+  bits[granule / 64] |= (uint64_t)1 << (granule % 64);
+}
+
+static void clearBit(uint64_t* bits, size_t granule) {
+  bits[granule / 64] &= ~((uint64_t)1 << (granule % 64));
+}
+
+// Objects allocated while a sweep is pending are allocated marked, the
+// sweeper would take them for garbage otherwise.
+static void addObject(HeapPage* page, void* slot) {
+  size_t granule = heapGranuleOf(slot);
+  setBit(page->allocBits, granule);
+  if (!page->swept) setBit(page->markBits, granule);
+  page->liveCount++;
+}
+
+void initHeap(Heap* heap) {
+  heap->pages = NULL;
+  heap->pageCount = 0;
+  heap->pageCapacity = 0;
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    heap->available[i] = NULL;
+  }
+}
+
+static HeapPage* newPage(Heap* heap, size_t size, int sizeClass) {
+  HeapPage* page = (HeapPage*)malloc(sizeof(HeapPage));
+  char* start = (char*)aligned_alloc(HEAP_PAGE_SIZE, size);
+  if (page == NULL || start == NULL) exit(1);
+
+  *(HeapPage**)start = page;
+  page->start = start;
+  page->size = size;
+  page->sizeClass = sizeClass;
+  page->slotSize = sizeClass == -1 ? size - HEAP_GRANULE : classSize(sizeClass);
+  page->freeList = NULL;
+  page->bump = start + HEAP_GRANULE;
+  page->end = start + HEAP_GRANULE +
+    (size - HEAP_GRANULE) / page->slotSize * page->slotSize;
+  page->liveCount = 0;
+  page->available = false;
+  page->nextAvailable = NULL;
+  page->swept = true;
+  page->evacuated = false;
+  memset(page->allocBits, 0, sizeof(page->allocBits));
+  memset(page->markBits, 0, sizeof(page->markBits));
+  ASAN_POISON_MEMORY_REGION(page->bump, page->end - page->bump);
+
+  if (heap->pageCapacity < heap->pageCount + 1) {
+    heap->pageCapacity = heap->pageCapacity < 8 ? 8 : heap->pageCapacity * 2;
+    heap->pages = (HeapPage**)realloc(heap->pages,
+        sizeof(HeapPage*) * heap->pageCapacity);
+    if (heap->pages == NULL) exit(1);
+  }
+  page->index = heap->pageCount;
+  heap->pages[heap->pageCount++] = page;
+  return page;
+}
+
+static void releasePage(Heap* heap, HeapPage* page) {
+  HeapPage* last = heap->pages[--heap->pageCount];
+  heap->pages[page->index] = last;
+  last->index = page->index;
+  free(page->start);
+  free(page);
+}
+
+static void* allocateLarge(Heap* heap, size_t size) {
+  size_t pageSize = (size + HEAP_GRANULE + HEAP_PAGE_SIZE - 1) &
+    ~(size_t)(HEAP_PAGE_SIZE - 1);
+  HeapPage* page = newPage(heap, pageSize, -1);
+  void* slot = page->bump;
+  page->bump = page->end;
+  ASAN_UNPOISON_MEMORY_REGION(slot, size);
+  addObject(page, slot);
+  return slot;
+}
+
+static void makeAvailable(Heap* heap, HeapPage* page) {
+  page->available = true;
+  page->nextAvailable = heap->available[page->sizeClass];
+  heap->available[page->sizeClass] = page;
+}
+
+static void* allocateInPage(HeapPage* page) {
+  void* slot;
+  if (page->freeList != NULL) {
+    slot = page->freeList;
+    ASAN_UNPOISON_MEMORY_REGION(slot, page->slotSize);
+    page->freeList = *(void**)slot;
+  } else if (page->bump < page->end) {
+    slot = page->bump;
+    ASAN_UNPOISON_MEMORY_REGION(slot, page->slotSize);
+    page->bump += page->slotSize;
+  } else {
+    return NULL;
+  }
+  addObject(page, slot);
+  return slot;
+}
+
+void* heapAllocate(Heap* heap, size_t size) {
+  if (size > HEAP_MAX_SMALL) return allocateLarge(heap, size);
+
+  int sizeClass = sizeClassOf(size);
+  HeapPage* page = heap->available[sizeClass];
+  if (page == NULL) {
+    page = newPage(heap, HEAP_PAGE_SIZE, sizeClass);
+    makeAvailable(heap, page);
+  }
+
+  void* slot = allocateInPage(page);
+  if (page->freeList == NULL && page->bump == page->end) {
+    heap->available[sizeClass] = page->nextAvailable;
+    page->available = false;
+    page->nextAvailable = NULL;
+  }
+
+  return slot;
+}
+
+void heapFree(Heap* heap, void* pointer) {
+  HeapPage* page = heapPageOf(pointer);
+  if (page->sizeClass == -1) {
+    releasePage(heap, page);
+    return;
+  }
+
+  clearBit(page->allocBits, heapGranuleOf(pointer));
+  *(void**)pointer = page->freeList;
+  page->freeList = pointer;
+  page->liveCount--;
+  ASAN_POISON_MEMORY_REGION(pointer, page->slotSize);
+
+  if (!page->available) makeAvailable(heap, page);
+}
+
+void heapClearMarks(Heap* heap) {
+  for (int i = 0; i < heap->pageCount; i++) {
+    memset(heap->pages[i]->markBits, 0, sizeof(heap->pages[i]->markBits));
+  }
+}
+
+void heapStartSweep(Heap* heap) {
+  for (int i = 0; i < heap->pageCount; i++) {
+    heap->pages[i]->swept = false;
+  }
+}
+
+static int slotsPerPage(int sizeClass) {
+  return (HEAP_PAGE_SIZE - HEAP_GRANULE) / classSize(sizeClass);
+}
+
+// Gives empty pages back to the system and relinks the pages that have
+// free slots.
+void heapReleaseEmpty(Heap* heap) {
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    heap->available[i] = NULL;
+  }
+
+  for (int i = heap->pageCount - 1; i >= 0; i--) {
+    HeapPage* page = heap->pages[i];
+    if (page->sizeClass == -1) continue;
+
+    if (page->liveCount == 0) {
+      releasePage(heap, page);
+    } else if (page->liveCount < slotsPerPage(page->sizeClass)) {
+      makeAvailable(heap, page);
+    } else {
+      page->available = false;
+      page->nextAvailable = NULL;
+    }
+  }
+}
+
+int heapSmallPages(Heap* heap) {
+  int count = 0;
+  for (int i = 0; i < heap->pageCount; i++) {
+    if (heap->pages[i]->sizeClass != -1) count++;
+  }
+  return count;
+}
+
+// How many pages compaction would free: per size class, the pages in use
+// minus the pages the live objects need when packed.
+int heapReclaimablePages(Heap* heap) {
+  int pages[HEAP_SIZE_CLASSES];
+  int live[HEAP_SIZE_CLASSES];
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    pages[i] = 0;
+    live[i] = 0;
+  }
+
+  for (int i = 0; i < heap->pageCount; i++) {
+    HeapPage* page = heap->pages[i];
+    if (page->sizeClass == -1) continue;
+    pages[page->sizeClass]++;
+    live[page->sizeClass] += page->liveCount;
+  }
+
+  int reclaimable = 0;
+  for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+    int perPage = slotsPerPage(i);
+    reclaimable += pages[i] - (live[i] + perPage - 1) / perPage;
+  }
+  return reclaimable;
+}
+
+static int byLiveCountDescending(const void* a, const void* b) {
+  return (*(HeapPage**)b)->liveCount - (*(HeapPage**)a)->liveCount;
+}
+
+// Moves every object out of the sparsest pages of each size class into
+// the free slots of the densest ones. The objects stay readable in the
+// evacuated pages until heapReleaseEvacuated(), so that move can leave a
+// forwarding address behind. Must not run while a sweep is pending.
+int heapEvacuate(Heap* heap, HeapMoveFn move) {
+  HeapPage** pages = (HeapPage**)malloc(sizeof(HeapPage*) * (heap->pageCount + 1));
+  if (pages == NULL) exit(1);
+  int moved = 0;
+
+  for (int sizeClass = 0; sizeClass < HEAP_SIZE_CLASSES; sizeClass++) {
+    int count = 0;
+    int live = 0;
+    for (int i = 0; i < heap->pageCount; i++) {
+      if (heap->pages[i]->sizeClass != sizeClass) continue;
+      pages[count++] = heap->pages[i];
+      live += heap->pages[i]->liveCount;
+    }
+
+    int perPage = slotsPerPage(sizeClass);
+    int needed = (live + perPage - 1) / perPage;
+    if (needed >= count) continue;
+
+    // The densest pages keep their objects and have room for the rest.
+    qsort(pages, count, sizeof(HeapPage*), byLiveCountDescending);
+    int target = 0;
+    for (int source = needed; source < count; source++) {
+      HeapPage* page = pages[source];
+      for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+        uint64_t bits = page->allocBits[word];
+        while (bits != 0) {
+          int bit = __builtin_ctzll(bits);
+          bits &= bits - 1;
+
+          void* to;
+          while ((to = allocateInPage(pages[target])) == NULL) target++;
+          move(heapObjectAt(page, (size_t)word * 64 + bit), to, page->slotSize);
+          moved++;
+        }
+      }
+      page->evacuated = true;
+    }
+  }
+
+  free(pages);
+  return moved;
+}
+
+void heapReleaseEvacuated(Heap* heap) {
+  for (int i = heap->pageCount - 1; i >= 0; i--) {
+    HeapPage* page = heap->pages[i];
+    if (!page->evacuated) continue;
+    memset(page->allocBits, 0, sizeof(page->allocBits));
+    page->liveCount = 0;
+  }
+  heapReleaseEmpty(heap);
+}
+
+void freeHeap(Heap* heap) {
+  for (int i = 0; i < heap->pageCount; i++) {
+    free(heap->pages[i]->start);
+    free(heap->pages[i]);
+  }
+  free(heap->pages);
+  initHeap(heap);
+}
@@ -0,0 +1,91 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include "value.h"
+
+// Objects live in aligned pages. The first granule of every page holds a
+// pointer to its HeapPage, which is kept outside the page together with
+// the mark bits, so marking never writes to object memory. The allocation
+// bits let the collector enumerate the objects of a page.
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define HEAP_GRANULE_SHIFT 3
+#define HEAP_GRANULE (1 << HEAP_GRANULE_SHIFT)
+#define HEAP_PAGE_GRANULES (HEAP_PAGE_SIZE / HEAP_GRANULE)
+#define HEAP_BITMAP_WORDS (HEAP_PAGE_GRANULES / 64)
+#define HEAP_SIZE_CLASSES 52
+#define HEAP_MAX_SMALL 8192
+
+typedef struct HeapPage HeapPage;
+
+struct HeapPage {
+  char* start;
+  size_t size;
+  int sizeClass; // -1 for a page holding one large object
+  size_t slotSize;
+  int index; // in Heap.pages
+
+  void* freeList;
+  char* bump;
+  char* end;
+  int liveCount;
+  bool available;
+  HeapPage* nextAvailable;
+  bool swept;
+  bool evacuated;
+
+  uint64_t allocBits[HEAP_BITMAP_WORDS];
+  uint64_t markBits[HEAP_BITMAP_WORDS];
+};
+
+typedef struct {
+  HeapPage** pages;
+  int pageCount;
+  int pageCapacity;
+  HeapPage* available[HEAP_SIZE_CLASSES];
+} Heap;
+
+void initHeap(Heap* heap);
+void freeHeap(Heap* heap);
+void* heapAllocate(Heap* heap, size_t size);
+void heapFree(Heap* heap, void* pointer);
+void heapClearMarks(Heap* heap);
+void heapStartSweep(Heap* heap);
+void heapReleaseEmpty(Heap* heap);
+
+typedef void (*HeapMoveFn)(void* from, void* to, size_t size);
+int heapReclaimablePages(Heap* heap);
+int heapSmallPages(Heap* heap);
+int heapEvacuate(Heap* heap, HeapMoveFn move);
+void heapReleaseEvacuated(Heap* heap);
+
+static inline HeapPage* heapPageOf(const void* pointer) {
+  return *(HeapPage**)((uintptr_t)pointer & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline size_t heapGranuleOf(const void* pointer) {
+  return ((uintptr_t)pointer & (HEAP_PAGE_SIZE - 1)) >> HEAP_GRANULE_SHIFT;
+}
+
+static inline Obj* heapObjectAt(HeapPage* page, size_t granule) {
+  return (Obj*)(page->start + (granule << HEAP_GRANULE_SHIFT));
+}
+
+static inline bool heapIsMarked(const void* pointer) {
+  HeapPage* page = heapPageOf(pointer);
+  size_t granule = heapGranuleOf(pointer);
+  uint64_t word = __atomic_load_n(&page->markBits[granule / 64], __ATOMIC_RELAXED);
+  return (word >> (granule % 64)) & 1;
+}
+
+// Returns whether the object was marked already. Safe to call from
+// several marker threads.
+static inline bool heapMark(const void* pointer) {
+  HeapPage* page = heapPageOf(pointer);
+  size_t granule = heapGranuleOf(pointer);
+  uint64_t bit = (uint64_t)1 << (granule % 64);
+  uint64_t old = __atomic_fetch_or(&page->markBits[granule / 64], bit, __ATOMIC_RELAXED);
+  return (old & bit) != 0;
+}
+
+#endif
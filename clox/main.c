@@ -1,10 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 # include "common.h"
+# include "batch.h"
 # include "chunk.h"
+# include "compiler.h"
 # include "debug.h"
+# include "file.h"
+# include "memory.h"
+# include "scanner.h"
 # include "value.h"
 # include "vm.h"
 # include "table.h"
@@ -21,62 +27,161 @@ static void repl() {
       break;
     }
 
-    interpret(line);
+    interpret(line, strlen(line));
   }
 }
 
-static char* readFile(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
-    exit(74);
-  }
-
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
-
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);
-  }
+static int runFile(const char* path) {
+  Source source;
+  if (!openSource(path, &source)) return 74;
+  InterpretResult result = source.text != NULL
+    ? interpret(source.text, source.length)
+    : interpretStream(source.fd);
+  closeSource(&source);
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+  return 0;
+}
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
+// Only tokenizes the script, for measuring the scanner.
+static int scanFile(const char* path) {
+  Source source;
+  if (!openSource(path, &source)) return 74;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (source.text != NULL) {
+    initScanner(source.text, source.length);
+  } else {
+    initScannerStream(source.fd);
   }
 
-  buffer[bytesRead] = '\0';
-
-  fclose(file);
-  return buffer;
+  long tokens = 0;
+  int errors = 0;
+  Token token;
+  do {
+    token = scanToken();
+    if (token.type == TOKEN_ERROR) errors++;
+    tokens++;
+  } while (token.type != TOKEN_EOF);
+  size_t bytes = scannedBytes();
+  freeScanner();
+  closeSource(&source);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(stderr, "[scan] %s: %ld tokens, %d errors, %.1f MB, %.1f MB/s\n",
+      path, tokens, errors, bytes / 1e6, bytes / 1e6 / seconds);
+  return errors == 0 ? 0 : 65;
 }
 
+static void printGCStats() {
+  fprintf(stderr, "[gc] %d collections, %.3f ms total pause, %.3f ms max pause\n",
+      vm.gcCount, vm.gcPauseTotal, vm.gcPauseMax);
+  fprintf(stderr, "[gc] %d compactions, %d pages\n",
+      vm.compactCount, vm.heap.pageCount);
+}
 
-static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void usage() {
+  fprintf(stderr, "Usage: clox [options] [path...]\n"
+      "  a path of - reads the script from stdin\n"
+      "  --jobs N           run the scripts on N worker threads\n"
+      "  --manifest file    read script paths from file, one per line\n"
+      "  -O                 optimize the bytecode\n"
+      "  --inline-report    print the calls -O inlined\n"
+      "  --lazy             compile functions on their first call\n"
+      "  --scan             only tokenize the scripts and print MB/s\n"
+      "  --gc-threads N     mark large heaps with N threads\n"
+      "  --gc-compact       compact fragmented heaps\n"
+      "  --gc-stats         print collection pause times at exit\n"
+      "  --heap-stats       print object counts and sizes at exit\n");
+  exit(64);
 }
 
 int main(int argc, const char* argv[]) {
     initVM();
+    int status = 0;
 
-    if (argc == 1) {
-      repl();
-    } else if (argc == 2 && strcmp(argv[1], "test") == 0) {
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
       /* runTests(); */
       printf("Tests run successfully.\n");
-    } else if (argc == 2) {
-      runFile(argv[1]);
+      freeVM();
+      return 0;
+    }
+
+    int jobs = -1;
+    bool gcStats = false;
+    bool heapStats = false;
+    bool scanOnly = false;
+    int count = 0;
+    int capacity = argc;
+    const char** paths = malloc(sizeof(char*) * capacity);
+
+    for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--jobs") == 0) {
+        if (++i == argc) usage();
+        jobs = atoi(argv[i]);
+      } else if (strcmp(argv[i], "--manifest") == 0) {
+        if (++i == argc) usage();
+        int manifestCount;
+        const char** manifest = readManifest(argv[i], &manifestCount);
+        if (manifest == NULL) exit(74);
+
+        capacity += manifestCount;
+        paths = realloc(paths, sizeof(char*) * capacity);
+        memcpy(paths + count, manifest, sizeof(char*) * manifestCount);
+        count += manifestCount;
+        if (jobs == -1) jobs = 0;
+        free(manifest);
+      } else if (strcmp(argv[i], "-O") == 0) {
+        setOptimization(true);
+      } else if (strcmp(argv[i], "--inline-report") == 0) {
+        setInlineReport(true);
+      } else if (strcmp(argv[i], "--lazy") == 0) {
+        setLazyCompilation(true);
+      } else if (strcmp(argv[i], "--scan") == 0) {
+        scanOnly = true;
+      } else if (strcmp(argv[i], "--gc-threads") == 0) {
+        if (++i == argc) usage();
+        setGCThreads(atoi(argv[i]));
+      } else if (strcmp(argv[i], "--gc-compact") == 0) {
+        setGCCompaction(true);
+      } else if (strcmp(argv[i], "--gc-stats") == 0) {
+        gcStats = true;
+      } else if (strcmp(argv[i], "--heap-stats") == 0) {
+        heapStats = true;
+      } else if (strncmp(argv[i], "--", 2) == 0) {
+        usage();
+      } else {
+        paths[count++] = strdup(argv[i]);
+      }
+    }
+
+    if (scanOnly) {
+      if (count == 0) usage();
+      for (int i = 0; i < count; i++) {
+        int scanStatus = scanFile(paths[i]);
+        if (status == 0) status = scanStatus;
+      }
+    } else if (count == 0) {
+      if (jobs != -1) usage();
+      repl();
+    } else if (count == 1 && jobs == -1) {
+      status = runFile(paths[0]);
     } else {
-      fprintf(stderr, "Usage: clox [path]\n");
+      // The stats are those of one VM, every worker runs its own.
+      if (gcStats || heapStats) {
+        fprintf(stderr, "--gc-stats and --heap-stats take a single script.\n");
+        exit(64);
+      }
+      status = runBatch(paths, count, jobs);
     }
 
+    if (gcStats) printGCStats();
+    if (heapStats) printHeapStats();
+
+    for (int i = 0; i < count; i++) free((char*)paths[i]);
+    free(paths);
     freeVM();
-    return 0;
+    return status;
 }
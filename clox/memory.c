@@ -1,16 +1,61 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "heap.h"
+#include "shape.h"
 #include "memory.h"
 #include "vm.h"
 #include "object.h"
 #include "value.h"
 #include "compiler.h"
 
-#ifdef DEBUG_LOG_GC
 #include <stdio.h>
+
+#ifdef DEBUG_LOG_GC
 #include "debug.h"
 #endif
 
+#define GC_HEAP_GROW_FACTOR 2
+// Pages swept per object allocation.
+#define GC_SWEEP_BUDGET 1
+// Compact when this share of the pages could be freed by moving objects.
+#define GC_COMPACT_THRESHOLD 0.25
+#define GC_COMPACT_MIN_PAGES 2
+// Below this heap size starting helper threads costs more than marking.
+#define GC_PARALLEL_THRESHOLD (4 * 1024 * 1024)
+#define GC_MAX_THREADS 64
+
+// Gray objects of one marker thread. The owner pushes and pops at the
+// end, other markers steal from the front.
+typedef struct {
+  pthread_mutex_t lock;
+  Obj** items;
+  int head;
+  int count;
+  int capacity;
+} GrayDeque;
+
+typedef struct {
+  GrayDeque deques[GC_MAX_THREADS];
+  int threadCount;
+  int idle;
+} ParallelMarker;
+
+typedef struct {
+  ParallelMarker* marker;
+  int id;
+} MarkerThread;
+
+static int gcThreads = 1;
+static bool gcCompact = false;
+
+// Set only while this thread takes part in a parallel mark.
+static _Thread_local GrayDeque* localGray = NULL;
+
 static void freeObject(Obj* obj) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", obj, obj->type);
@@ -25,27 +70,81 @@ static void freeObject(Obj* obj) {
     case OBJ_FUNCTION: {
       ObjFunction* func = (ObjFunction*)obj;
       freeChunk(&func->chunk);
-      FREE(ObjFunction, func);
+      if (func->lazy != NULL) freeLazyBody(func);
+      FREE_OBJ(ObjFunction, func);
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)obj;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues,
-                 closure->upvalueCount);
-      FREE(ObjClosure, obj);
+      if (closure->upvalues != NULL) {
+        FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+      }
+      if (closure->values != NULL) {
+        FREE_ARRAY(Value, closure->values, closure->upvalueCount);
+      }
+      FREE_OBJ(ObjClosure, obj);
       break;
     }
     case OBJ_UPVALUE: {
-      FREE(ObjUpvalue, obj);
+      FREE_OBJ(ObjUpvalue, obj);
       break;
     }
     case OBJ_NATIVE: {
-      FREE(ObjNative, obj);
+      FREE_OBJ(ObjNative, obj);
+      break;
+    }
+    case OBJ_LIST: {
+      ObjList* list = (ObjList*)obj;
+      freeValueArray(&list->items);
+      FREE_OBJ(ObjList, obj);
+      break;
+    }
+    case OBJ_FLOAT_ARRAY: {
+      ObjFloatArray* array = (ObjFloatArray*)obj;
+      FREE_ARRAY(double, array->values, array->count);
+      FREE_OBJ(ObjFloatArray, obj);
+      break;
+    }
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*)obj;
+      freeValueTable(&map->table);
+      FREE_OBJ(ObjMap, obj);
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)obj;
+      freeTable(&klass->methods);
+      FREE_OBJ(ObjClass, obj);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)obj;
+      FREE_ARRAY(Value, instance->fields, instance->capacity);
+      FREE_OBJ(ObjInstance, obj);
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      FREE_OBJ(ObjBoundMethod, obj);
+      break;
+    }
+    case OBJ_STRING_BUILDER: {
+      ObjStringBuilder* builder = (ObjStringBuilder*)obj;
+      FREE_ARRAY(char, builder->chars, builder->capacity);
+      FREE_OBJ(ObjStringBuilder, obj);
       break;
     }
   }
 }
 
+// The field names of the shapes, the only objects they refer to.
+static void markShape(Shape* shape) {
+  if (shape == NULL) return; // initVM() is still making the root
+  markObject((Obj*)shape->name);
+  for (int i = 0; i < shape->childCount; i++) {
+    markShape(shape->children[i]);
+  }
+}
+
 static void markRoots() {
   for (int i = 0; i < vm.stackSize; i++) {
     markValue(vm.stack[i]);
@@ -55,13 +154,12 @@ static void markRoots() {
     markObject((Obj*)vm.frames[i].closure);
   }
 
-  for (ObjUpvalue* upvalue = vm.openUpvalues;
-       upvalue != NULL;
-       upvalue = upvalue->next) {
-    markObject((Obj*)upvalue);
+  for (int i = 0; i < vm.openTop; i++) {
+    markObject((Obj*)vm.openUpvalues[i]);
   }
 
   markTable(&vm.globals);
+  markShape(vm.rootShape);
   markCompilerRoots();
 }
 
@@ -80,7 +178,9 @@ static void blackenObject(Obj* object) {
 
   switch (object->type) {
     case OBJ_STRING:
-    case OBJ_NATIVE: break;
+    case OBJ_NATIVE:
+    case OBJ_FLOAT_ARRAY:
+    case OBJ_STRING_BUILDER: break;
     case OBJ_UPVALUE: {
       markValue(((ObjUpvalue*)object)->closed);
       break;
@@ -89,16 +189,56 @@ static void blackenObject(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
       markArray(function->chunk.constants);
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        for (int way = 0; way < CACHE_WAYS; way++) {
+          markObject(function->chunk.caches[i].entries[way].klass);
+          markObject(function->chunk.caches[i].entries[way].method);
+        }
+      }
       break;
     }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
       markObject((Obj*)closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);
+        if (closure->upvalues != NULL) markObject((Obj*)closure->upvalues[i]);
+        if (closure->values != NULL) markValue(closure->values[i]);
+      }
+      break;
+    }
+    case OBJ_LIST:
+      markArray(((ObjList*)object)->items);
+      break;
+    case OBJ_MAP: {
+      // Free entries have a NULL key, markObject skips those.
+      ValueTable* table = &((ObjMap*)object)->table;
+      for (int i = 0; i < table->capacity; i++) {
+        markValue(table->entries[i].key);
+        markValue(table->entries[i].value);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      markObject((Obj*)klass->name);
+      markTable(&klass->methods);
+      markObject((Obj*)klass->initializer);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      markObject((Obj*)instance->klass);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(instance->fields[i]);
       }
       break;
     }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      markValue(bound->receiver);
+      markObject((Obj*)bound->method);
+      break;
+    }
   }
 }
 
@@ -109,23 +249,187 @@ static void traceReferences() {
   }
 }
 
-static void sweep() {
-  Obj* previous = NULL;
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj* next = object->next;
-      if (previous != NULL) {
-        previous->next = next;
+// count is also read without the lock to skip empty deques quickly.
+static void setDequeCount(GrayDeque* deque, int count) {
+  __atomic_store_n(&deque->count, count, __ATOMIC_RELAXED);
+}
+
+static void pushDeque(GrayDeque* deque, Obj* object) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->capacity < deque->count + 1) {
+    deque->capacity = GROW_CAPACITY(deque->capacity);
+    deque->items = (Obj**)realloc(deque->items, sizeof(Obj*) * deque->capacity);
+    if (deque->items == NULL) exit(1);
+  }
+  deque->items[deque->count] = object;
+  setDequeCount(deque, deque->count + 1);
+  pthread_mutex_unlock(&deque->lock);
+}
+
+static Obj* popDeque(GrayDeque* deque) {
+  Obj* object = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > deque->head) {
+    object = deque->items[deque->count - 1];
+    setDequeCount(deque, deque->count - 1);
+    if (deque->count == deque->head) {
+      deque->head = 0;
+      setDequeCount(deque, 0);
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return object;
+}
+
+static Obj* stealDeque(GrayDeque* deque) {
+  Obj* object = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > deque->head) {
+    object = deque->items[deque->head++];
+    if (deque->count == deque->head) {
+      deque->head = 0;
+      setDequeCount(deque, 0);
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return object;
+}
+
+static Obj* stealAny(ParallelMarker* marker, int id) {
+  for (int i = 1; i < marker->threadCount; i++) {
+    GrayDeque* victim = &marker->deques[(id + i) % marker->threadCount];
+    if (__atomic_load_n(&victim->count, __ATOMIC_RELAXED) == 0) continue;
+    Obj* object = stealDeque(victim);
+    if (object != NULL) return object;
+  }
+  return NULL;
+}
+
+static bool hasGrayWork(ParallelMarker* marker) {
+  for (int i = 0; i < marker->threadCount; i++) {
+    if (__atomic_load_n(&marker->deques[i].count, __ATOMIC_RELAXED) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Markers only go idle with an empty deque and idle markers create no new
+// gray objects, so once every marker is idle the mark is complete.
+static void* markerMain(void* arg) {
+  MarkerThread* thread = (MarkerThread*)arg;
+  ParallelMarker* marker = thread->marker;
+  GrayDeque* own = &marker->deques[thread->id];
+  localGray = own;
+
+  for (;;) {
+    Obj* object;
+    while ((object = popDeque(own)) != NULL) blackenObject(object);
+
+    object = stealAny(marker, thread->id);
+    if (object != NULL) {
+      blackenObject(object);
+      continue;
+    }
+
+    __atomic_add_fetch(&marker->idle, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&marker->idle, __ATOMIC_SEQ_CST) == marker->threadCount) {
+        localGray = NULL;
+        return NULL;
+      }
+      if (hasGrayWork(marker)) {
+        __atomic_sub_fetch(&marker->idle, 1, __ATOMIC_SEQ_CST);
+        break;
       }
-      freeObject(object);
-      object = next;
+      sched_yield();
+    }
+  }
+}
+
+// The calling thread is marker 0, the others are started per collection.
+static void traceReferencesParallel() {
+  ParallelMarker marker;
+  MarkerThread threads[GC_MAX_THREADS];
+  pthread_t handles[GC_MAX_THREADS];
+
+  marker.threadCount = gcThreads;
+  marker.idle = 0;
+  for (int i = 0; i < marker.threadCount; i++) {
+    GrayDeque* deque = &marker.deques[i];
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->items = NULL;
+    deque->head = 0;
+    deque->count = 0;
+    deque->capacity = 0;
+  }
+
+  for (int i = 0; i < vm.grayCount; i++) {
+    pushDeque(&marker.deques[i % marker.threadCount], vm.grayStack[i]);
+  }
+  vm.grayCount = 0;
+
+  for (int i = 0; i < marker.threadCount; i++) {
+    threads[i].marker = &marker;
+    threads[i].id = i;
+    if (i > 0) pthread_create(&handles[i], NULL, markerMain, &threads[i]);
+  }
+  markerMain(&threads[0]);
+
+  for (int i = 0; i < marker.threadCount; i++) {
+    if (i > 0) pthread_join(handles[i], NULL);
+    pthread_mutex_destroy(&marker.deques[i].lock);
+    free(marker.deques[i].items);
+  }
+}
+
+// Frees the unmarked objects of a page. Returns false if that released
+// the page itself, which moves another page into its slot in the heap.
+static bool sweepPage(HeapPage* page) {
+  page->swept = true;
+  for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+    uint64_t dead = page->allocBits[i] & ~page->markBits[i];
+    while (dead != 0) {
+      int bit = __builtin_ctzll(dead);
+      dead &= dead - 1;
+      bool large = page->sizeClass == -1;
+      freeObject(heapObjectAt(page, (size_t)i * 64 + bit));
+      if (large) return false;
     }
   }
+  return true;
+}
+
+// Sweeps the pages left by the last collection. The allocator calls this
+// with a small budget, so the pause of a collection is only marking.
+static void sweep(int budget) {
+  if (!vm.sweeping) return;
+
+  while (vm.sweepCursor < vm.heap.pageCount && budget > 0) {
+    HeapPage* page = vm.heap.pages[vm.sweepCursor];
+    if (page->swept) {
+      vm.sweepCursor++;
+      continue;
+    }
+    if (sweepPage(page)) vm.sweepCursor++;
+    budget--;
+  }
+
+  if (vm.sweepCursor == vm.heap.pageCount) {
+    vm.sweeping = false;
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    heapReleaseEmpty(&vm.heap);
+
+    int reclaimable = heapReclaimablePages(&vm.heap);
+    if (gcCompact && reclaimable >= GC_COMPACT_MIN_PAGES &&
+        reclaimable >= heapSmallPages(&vm.heap) * GC_COMPACT_THRESHOLD) {
+      vm.compactPending = true;
+    }
+#ifdef DEBUG_LOG_GC
+    printf("-- sweep done, %zu bytes live, next at %zu\n",
+           vm.bytesAllocated, vm.nextGC);
+#endif
+  }
 }
 
 void markTable(Table* table) {
@@ -142,8 +446,8 @@ void markValue(Value value) {
 
 void markObject(Obj* object) {
   if (object == NULL) return;
-  if (object->isMarked) return;
-  object->isMarked = true;
+  if (heapIsMarked(object)) return;
+  if (heapMark(object)) return;
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", object);
@@ -151,6 +455,11 @@ void markObject(Obj* object) {
   printf("\n");
 #endif
 
+  if (localGray != NULL) {
+    pushDeque(localGray, object);
+    return;
+  }
+
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
@@ -160,11 +469,41 @@ void markObject(Obj* object) {
   vm.grayStack[vm.grayCount++] = object;
 }
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-  if (newSize > oldSize) {
+void setGCCompaction(bool enabled) {
+  gcCompact = enabled;
+}
+
+void setGCThreads(int count) {
+  if (count < 1) count = 1;
+  if (count > GC_MAX_THREADS) count = GC_MAX_THREADS;
+  gcThreads = count;
+}
+
+static void collectIfNeeded() {
 #ifdef DEBUG_STRESS_GC
-    collectGarbage();
+  collectGarbage();
 #endif
+
+  if (vm.bytesAllocated > vm.nextGC) {
+    collectGarbage();
+  }
+}
+
+void* allocateObjectMemory(size_t size) {
+  vm.bytesAllocated += size;
+  collectIfNeeded();
+  return heapAllocate(&vm.heap, size);
+}
+
+void freeObjectMemory(void* pointer, size_t size) {
+  vm.bytesAllocated -= size;
+  heapFree(&vm.heap, pointer);
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+    collectIfNeeded();
   }
 
   if (newSize == 0) {
@@ -178,12 +517,257 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING: return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_CLOSURE: return sizeof(ObjClosure);
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_LIST: return sizeof(ObjList);
+    case OBJ_FLOAT_ARRAY: return sizeof(ObjFloatArray);
+    case OBJ_MAP: return sizeof(ObjMap);
+    case OBJ_CLASS: return sizeof(ObjClass);
+    case OBJ_INSTANCE: return sizeof(ObjInstance);
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_STRING_BUILDER: return sizeof(ObjStringBuilder);
+  }
+  return 0;
+}
+
+// Counts every allocated object, garbage not swept yet included.
+void printHeapStats() {
+  static const char* names[] = {
+    [OBJ_STRING] = "string",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_UPVALUE] = "upvalue",
+    [OBJ_NATIVE] = "native",
+    [OBJ_LIST] = "list",
+    [OBJ_FLOAT_ARRAY] = "float array",
+    [OBJ_MAP] = "map",
+    [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_BOUND_METHOD] = "bound method",
+    [OBJ_STRING_BUILDER] = "string builder",
+  };
+  const int typeCount = sizeof(names) / sizeof(names[0]);
+  size_t counts[typeCount];
+  size_t bytes[typeCount];
+  size_t slotBytes[typeCount];
+  for (int i = 0; i < typeCount; i++) {
+    counts[i] = bytes[i] = slotBytes[i] = 0;
+  }
+
+  for (int i = 0; i < vm.heap.pageCount; i++) {
+    HeapPage* page = vm.heap.pages[i];
+    for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+      uint64_t live = page->allocBits[word];
+      while (live != 0) {
+        int bit = __builtin_ctzll(live);
+        live &= live - 1;
+        Obj* object = heapObjectAt(page, (size_t)word * 64 + bit);
+        counts[object->type]++;
+        bytes[object->type] += objectSize(object);
+        slotBytes[object->type] += page->slotSize;
+      }
+    }
+  }
+
+  fprintf(stderr, "[heap] %d pages, header %zu bytes\n",
+      vm.heap.pageCount, sizeof(Obj));
+  for (int i = 0; i < typeCount; i++) {
+    if (counts[i] == 0) continue;
+    fprintf(stderr, "[heap] %-8s %8zu objects %6.1f bytes/object %6.1f with slack\n",
+        names[i], counts[i], (double)bytes[i] / counts[i],
+        (double)slotBytes[i] / counts[i]);
+  }
+}
+
+// The first word of a moved object's old copy points to the new copy.
+#define FORWARDING(object) (*(Obj**)((char*)(object) + sizeof(Obj*)))
+
+static void moveObject(void* from, void* to, size_t size) {
+  memcpy(to, from, size);
+  Obj* object = (Obj*)to;
+  if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue* upvalue = (ObjUpvalue*)object;
+    if (upvalue->location == &((ObjUpvalue*)from)->closed) {
+      upvalue->location = &upvalue->closed;
+    }
+  }
+  FORWARDING(from) = object;
+}
+
+static Obj* forward(Obj* object) {
+  if (object == NULL || !heapPageOf(object)->evacuated) return object;
+  return FORWARDING(object);
+}
+
+static void forwardValue(Value* value) {
+  if (IS_OBJ(*value)) value->as.obj = forward(AS_OBJ(*value));
+}
+
+static void forwardTable(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    entry->key = (ObjString*)forward((Obj*)entry->key);
+    forwardValue(&entry->value);
+  }
+}
+
+static void forwardShape(Shape* shape) {
+  if (shape == NULL) return;
+  shape->name = (ObjString*)forward((Obj*)shape->name);
+  for (int i = 0; i < shape->childCount; i++) {
+    forwardShape(shape->children[i]);
+  }
+}
+
+static void forwardFields(Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+    case OBJ_FLOAT_ARRAY:
+    case OBJ_STRING_BUILDER: break;
+    case OBJ_UPVALUE: {
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      forwardValue(&upvalue->closed);
+      break;
+    }
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      function->name = (ObjString*)forward((Obj*)function->name);
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        forwardValue(&function->chunk.constants.values[i]);
+      }
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        for (int way = 0; way < CACHE_WAYS; way++) {
+          CacheEntry* entry = &function->chunk.caches[i].entries[way];
+          entry->klass = forward(entry->klass);
+          entry->method = forward(entry->method);
+        }
+      }
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      closure->function = (ObjFunction*)forward((Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        if (closure->upvalues != NULL) {
+          closure->upvalues[i] = (ObjUpvalue*)forward((Obj*)closure->upvalues[i]);
+        }
+        if (closure->values != NULL) forwardValue(&closure->values[i]);
+      }
+      break;
+    }
+    case OBJ_LIST: {
+      ValueArray* items = &((ObjList*)object)->items;
+      for (int i = 0; i < items->count; i++) {
+        forwardValue(&items->values[i]);
+      }
+      break;
+    }
+    case OBJ_MAP: {
+      // String keys keep their hash when moved, no rehashing needed.
+      ValueTable* table = &((ObjMap*)object)->table;
+      for (int i = 0; i < table->capacity; i++) {
+        forwardValue(&table->entries[i].key);
+        forwardValue(&table->entries[i].value);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      klass->name = (ObjString*)forward((Obj*)klass->name);
+      forwardTable(&klass->methods);
+      klass->initializer = (ObjClosure*)forward((Obj*)klass->initializer);
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      instance->klass = (ObjClass*)forward((Obj*)instance->klass);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        forwardValue(&instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      forwardValue(&bound->receiver);
+      bound->method = (ObjClosure*)forward((Obj*)bound->method);
+      break;
+    }
+  }
+}
+
+// Moves objects out of sparse pages and frees those pages. Every pointer
+// to a moved object has to be found, so this only runs where the
+// interpreter holds no object pointers of its own, see run().
+void compactHeap() {
+  vm.compactPending = false;
+  sweep(INT_MAX);
+
+  int moved = heapEvacuate(&vm.heap, moveObject);
+  if (moved == 0) return;
+
+  for (int i = 0; i < vm.stackSize; i++) {
+    forwardValue(&vm.stack[i]);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].closure = (ObjClosure*)forward((Obj*)vm.frames[i].closure);
+  }
+  for (int i = 0; i < vm.openTop; i++) {
+    vm.openUpvalues[i] = (ObjUpvalue*)forward((Obj*)vm.openUpvalues[i]);
+  }
+  forwardTable(&vm.globals);
+  forwardTable(&vm.strings);
+  forwardShape(vm.rootShape);
+
+  for (int i = 0; i < vm.heap.pageCount; i++) {
+    HeapPage* page = vm.heap.pages[i];
+    if (page->evacuated) continue;
+    for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+      uint64_t live = page->allocBits[word];
+      while (live != 0) {
+        int bit = __builtin_ctzll(live);
+        live &= live - 1;
+        forwardFields(heapObjectAt(page, (size_t)word * 64 + bit));
+      }
+    }
+  }
+
+  int pages = vm.heap.pageCount;
+  heapReleaseEvacuated(&vm.heap);
+  vm.compactCount++;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- compact moved %d objects, released %d pages\n",
+         moved, pages - vm.heap.pageCount);
+#endif
+}
+
+void sweepSome() {
+  sweep(GC_SWEEP_BUDGET);
+}
+
 void freeObjects() {
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+  // Going backwards, released pages are replaced by ones already freed.
+  for (int i = vm.heap.pageCount - 1; i >= 0; i--) {
+    HeapPage* page = vm.heap.pages[i];
+    if (page->sizeClass == -1) {
+      freeObject(heapObjectAt(page, 1));
+      continue;
+    }
+
+    for (int word = 0; word < HEAP_BITMAP_WORDS; word++) {
+      uint64_t live = page->allocBits[word];
+      while (live != 0) {
+        int bit = __builtin_ctzll(live);
+        live &= live - 1;
+        freeObject(heapObjectAt(page, (size_t)word * 64 + bit));
+      }
+    }
   }
 
   free(vm.grayStack);
@@ -193,11 +777,34 @@ void collectGarbage() {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
 #endif
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Unswept survivors are still marked and would not be traced again.
+  sweep(INT_MAX);
+  heapClearMarks(&vm.heap);
 
   markRoots();
-  traceReferences();
+  if (gcThreads > 1 && vm.bytesAllocated >= GC_PARALLEL_THRESHOLD) {
+    traceReferencesParallel();
+  } else {
+    traceReferences();
+  }
   tableRemoveWhite(&vm.strings);
-  sweep();
+
+  heapStartSweep(&vm.heap);
+  vm.sweeping = true;
+  vm.sweepCursor = 0;
+  // Lowered again once the garbage has been swept.
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double pause = (end.tv_sec - start.tv_sec) * 1000.0 +
+    (end.tv_nsec - start.tv_nsec) / 1000000.0;
+  vm.gcCount++;
+  vm.gcPauseTotal += pause;
+  if (pause > vm.gcPauseMax) vm.gcPauseMax = pause;
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
@@ -5,29 +5,39 @@
 #include "table.h"
 
 #define ALLOCATE(type, count) \
-  (type*)reallocate(NULL, 0, sizeof(type) * count)
+  (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
 #define GROW_CAPACITY(capacity) \
    ((capacity) < 8 ? 8 : (capacity) * 2)
 
 #define GROW_ARRAY(type, pointer, oldCount, newCount) \
-   (type*)reallocate(pointer, sizeof(type) * oldCount, sizeof(type) * newCount)
+   (type*)reallocate(pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
 
 #define FREE_ARRAY(type, pointer, oldCount) \
-   reallocate(pointer, sizeof(type) * oldCount, 0)
+   reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 #define FREE(type, pointer) \
    reallocate(pointer, sizeof(type), 0)
 
+#define FREE_OBJ(type, pointer) \
+   freeObjectMemory(pointer, sizeof(type))
+
 #define FREE_OBJ_STRING(pointer) \
-   reallocate(pointer, sizeof(ObjString) + sizeof(char) * pointer->length, 0)
+   freeObjectMemory(pointer, sizeof(ObjString) + sizeof(char) * (pointer->length + 1))
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateObjectMemory(size_t size);
+void freeObjectMemory(void* pointer, size_t size);
 void freeObjects();
+void sweepSome();
+void printHeapStats();
 void freeTable(Table* table);
 void collectGarbage();
 void markValue(Value value);
 void markObject(Obj* object);
 void markTable(Table* table);
+void setGCThreads(int count);
+void setGCCompaction(bool enabled);
+void compactHeap();
 
 #endif
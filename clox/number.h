@@ -0,0 +1,9 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+double parseNumber(const char* start, int length);
+bool parseInteger(const char* start, int length, int64_t* value);
+
+#endif
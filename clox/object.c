@@ -14,12 +14,9 @@
   (ObjString*)allocateObject(sizeof(ObjString) + length * sizeof(char), OBJ_STRING)
 
 static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  sweepSome();
+  Obj* object = (Obj*)allocateObjectMemory(size);
   object->type = type;
-  object->isMarked = false;
-
-  object->next = vm.objects;
-  vm.objects = object;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", object, size, type);
@@ -34,17 +31,83 @@ static ObjString* allocateString(const char* chars, int length, uint32_t hash) {
   string->hash = hash;
   memcpy(string->chars, chars, length);
   string->chars[length] = '\0';
+  push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NIL_VAL);
+  pop();
   return string;
 }
 
+// wyhash: eight bytes per step folded with a 64x64->128 bit multiply,
+// where FNV-1a took a multiply per byte. The seed is fixed so that the
+// order of map keys is the same from run to run, see HASH_SEED.
+static const uint64_t hashSecret[4] = {
+  0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+  0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+  __uint128_t product = (__uint128_t)a * b;
+  return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
 uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+  const uint8_t* p = (const uint8_t*)key;
+  size_t left = (size_t)length;
+  uint64_t seed = (uint64_t)HASH_SEED ^ hashMix((uint64_t)HASH_SEED ^ hashSecret[0], hashSecret[1]);
+  uint64_t a, b;
+
+  if (left <= 16) {
+    if (left >= 4) {
+      // Two overlapping pairs of words cover 4..16 bytes.
+      size_t middle = (left >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + middle);
+      b = (read32(p + left - 4) << 32) | read32(p + left - 4 - middle);
+    } else if (left > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[left >> 1] << 8) | p[left - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (left > 48) {
+      uint64_t second = seed, third = seed;
+      do {
+        seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+        second = hashMix(read64(p + 16) ^ hashSecret[2], read64(p + 24) ^ second);
+        third = hashMix(read64(p + 32) ^ hashSecret[3], read64(p + 40) ^ third);
+        p += 48;
+        left -= 48;
+      } while (left > 48);
+      seed ^= second ^ third;
+    }
+    while (left > 16) {
+      seed = hashMix(read64(p) ^ hashSecret[1], read64(p + 8) ^ seed);
+      p += 16;
+      left -= 16;
+    }
+    // The last 16 bytes, overlapping what came before.
+    a = read64(p + left - 16);
+    b = read64(p + left - 8);
   }
-  return hash;
+
+  a ^= hashSecret[1];
+  b ^= seed;
+  __uint128_t product = (__uint128_t)a * b;
+  a = (uint64_t)product;
+  b = (uint64_t)(product >> 64);
+  return (uint32_t)hashMix(a ^ hashSecret[0] ^ (uint64_t)length, b ^ hashSecret[1]);
 }
 
 ObjString* copyString(const char* chars, int length) {
@@ -59,20 +122,34 @@ ObjFunction* newFunction() {
   function->arity = 0;
   function->name = NULL;
   function->upvalueCount = 0;
+  function->valueCount = 0;
+  function->lazy = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
+  int count = function->upvalueCount;
+  ObjUpvalue** upvalues = NULL;
+  if (function->valueCount < count) {
+    upvalues = ALLOCATE(ObjUpvalue*, count);
+    for (int i = 0; i < count; i++) {
+      upvalues[i] = NULL;
+    }
+  }
+  Value* values = NULL;
+  if (function->valueCount > 0) {
+    values = ALLOCATE(Value, count);
+    for (int i = 0; i < count; i++) {
+      values[i] = NIL_VAL;
+    }
   }
 
   ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
   closure->function = function;
   closure->upvalues = upvalues;
-  closure->upvalueCount = function->upvalueCount;
+  closure->values = values;
+  closure->upvalueCount = count;
 
   return closure;
 }
@@ -80,45 +157,163 @@ ObjClosure* newClosure(ObjFunction* function) {
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
-  upvalue->next = NULL;
   upvalue->closed = NIL_VAL;
   return upvalue;
 }
 
-static void printFunction(ObjFunction* func) {
+static void printFunction(FILE* out, ObjFunction* func) {
   if (func->name == NULL) {
-    printf("<script>");
+    fprintf(out, "<script>");
   } else {
-    printf("<fn %s>", func->name->chars);
+    fprintf(out, "<fn %s>", func->name->chars);
+  }
+}
+
+static void printFloatArray(FILE* out, ObjFloatArray* array) {
+  fputc('[', out);
+  for (int i = 0; i < array->count; i++) {
+    if (i > 0) fprintf(out, ", ");
+    fprintf(out, "%g", array->values[i]);
   }
+  fputc(']', out);
 }
 
-void printObject(Value value) {
+static void printList(FILE* out, ObjList* list) {
+  fputc('[', out);
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) fprintf(out, ", ");
+    fprintValue(out, list->items.values[i]);
+  }
+  fputc(']', out);
+}
+
+static void printMap(FILE* out, ObjMap* map) {
+  fputc('{', out);
+  bool first = true;
+  for (int i = 0; i < map->table.capacity; i++) {
+    MapEntry* entry = &map->table.entries[i];
+    if (IS_NO_KEY(entry->key)) continue;
+    if (!first) fprintf(out, ", ");
+    first = false;
+    fprintValue(out, entry->key);
+    fprintf(out, ": ");
+    fprintValue(out, entry->value);
+  }
+  fputc('}', out);
+}
+
+void printObject(FILE* out, Value value) {
   switch(OBJ_TYPE(value)) {
     case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
+      fprintf(out, "%s", AS_CSTRING(value));
       break;
     case OBJ_FUNCTION:
-      printFunction(AS_FUNCTION(value));
+      printFunction(out, AS_FUNCTION(value));
       break;
     case OBJ_CLOSURE:
-      printFunction(AS_CLOSURE(value)->function);
+      printFunction(out, AS_CLOSURE(value)->function);
       break;
     case OBJ_UPVALUE:
-      printf("upvalue");
+      fprintf(out, "upvalue");
       break;
     case OBJ_NATIVE:
-      printf("<native fn>");
+      fprintf(out, "<native fn>");
+      break;
+    case OBJ_LIST:
+      printList(out, AS_LIST(value));
+      break;
+    case OBJ_FLOAT_ARRAY:
+      printFloatArray(out, AS_FLOAT_ARRAY(value));
+      break;
+    case OBJ_MAP:
+      printMap(out, AS_MAP(value));
+      break;
+    case OBJ_CLASS:
+      fprintf(out, "%s", AS_CLASS(value)->name->chars);
+      break;
+    case OBJ_INSTANCE:
+      fprintf(out, "%s instance", AS_INSTANCE(value)->klass->name->chars);
+      break;
+    case OBJ_BOUND_METHOD:
+      printFunction(out, AS_BOUND_METHOD(value)->method->function);
+      break;
+    case OBJ_STRING_BUILDER:
+      fprintf(out, "<string builder>");
       break;
   }
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjNative* newNative(NativeFn function, const char* name, int arity) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->name = name;
+  native->arity = arity;
   return native;
 }
 
+ObjList* newList() {
+  ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  initValueArray(&list->items);
+  return list;
+}
+
+ObjMap* newMap() {
+  ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  initValueTable(&map->table);
+  return map;
+}
+
+ObjClass* newClass(ObjString* name) {
+  ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+  klass->name = name;
+  initTable(&klass->methods);
+  klass->initializer = NULL;
+  klass->fieldCount = 0;
+  return klass;
+}
+
+// Room is made for as many fields as instances of the class have had. The
+// fields are allocated before the instance, like the values of a float
+// array.
+ObjInstance* newInstance(ObjClass* klass) {
+  Value* fields = ALLOCATE(Value, klass->fieldCount);
+  ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  instance->klass = klass;
+  instance->shape = vm.rootShape;
+  instance->fields = fields;
+  instance->capacity = klass->fieldCount;
+  return instance;
+}
+
+ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
+  ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+ObjStringBuilder* newStringBuilder() {
+  ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+  builder->chars = NULL;
+  builder->length = 0;
+  builder->capacity = 0;
+  return builder;
+}
+
+// The elements are zeroed. They are allocated first, a collection while
+// allocating them cannot see the array.
+ObjFloatArray* newFloatArray(int count) {
+  double* values = NULL;
+  if (count > 0) {
+    values = ALLOCATE(double, count);
+    memset(values, 0, sizeof(double) * count);
+  }
+  ObjFloatArray* array = ALLOCATE_OBJ(ObjFloatArray, OBJ_FLOAT_ARRAY);
+  array->count = count;
+  array->values = values;
+  return array;
+}
+
 // alkuperäinen toteutus
 
 /* static Obj* allocateObject(size_t size, ObjType type) { */
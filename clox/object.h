@@ -4,6 +4,7 @@
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
+#include "table.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -11,12 +12,26 @@
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_FLOAT_ARRAY(value) isObjType(value, OBJ_FLOAT_ARRAY)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
 
 #define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
 
 typedef enum {
   OBJ_STRING,
@@ -24,12 +39,19 @@ typedef enum {
   OBJ_CLOSURE,
   OBJ_UPVALUE,
   OBJ_NATIVE,
+  OBJ_LIST,
+  OBJ_FLOAT_ARRAY,
+  OBJ_MAP,
+  OBJ_CLASS,
+  OBJ_INSTANCE,
+  OBJ_BOUND_METHOD,
+  OBJ_STRING_BUILDER,
 } ObjType;
 
+// Mark bits are kept in side bitmaps and objects are found through the
+// heap pages (see heap.h), so the header is only the type.
 struct Obj {
-  ObjType type;
-  struct Obj* next;
-  bool isMarked;
+  uint8_t type;
 };
 
 struct ObjString {
@@ -44,41 +66,126 @@ typedef struct ObjUpvalue ObjUpvalue;
 struct ObjUpvalue {
   Obj obj;
   Value* location;
-  ObjUpvalue* next;
   Value closed;
 };
 
+typedef struct {
+  int start; // in LazyBody.source
+  int length;
+} LazyCapture;
+
+// The saved tokens of a function that is compiled on its first call, and
+// the names of its upvalues, see compiler.c.
+typedef struct {
+  char* source;
+  int length;
+  int line;
+  LazyCapture* captures;
+  int type; // FunctionType, see compiler.c
+  bool inClass;
+  bool hasSuperclass;
+} LazyBody;
+
 typedef struct {
   Obj obj;
   int arity;
   Chunk chunk;
   ObjString* name;
   int upvalueCount;
+  int valueCount; // upvalues captured by value
+  LazyBody* lazy; // NULL once compiled
 } ObjFunction;
 
+// An upvalue captured by value is in values, the others in upvalues. The
+// arrays are NULL when the function has no upvalues of the kind.
 typedef struct {
   Obj obj;
   ObjFunction* function;
   ObjUpvalue** upvalues;
+  Value* values;
   int upvalueCount;
 } ObjClosure;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// Returns false after reporting a runtime error. args points at the
+// arguments on the VM stack, which keeps them alive, but it moves when
+// push() grows the stack, so a native that pushes reads them first.
+typedef bool (*NativeFn)(int argCount, Value* args, Value* result);
 
 typedef struct {
   Obj obj;
   NativeFn function;
+  const char* name;
+  int arity; // -1 for any number of arguments
 } ObjNative;
 
+// The items are outside the heap pages, only the header moves.
+typedef struct {
+  Obj obj;
+  ValueArray items;
+} ObjList;
+
+// Unboxed doubles with a fixed length, see floatarray.c.
+typedef struct {
+  Obj obj;
+  int count;
+  double* values;
+} ObjFloatArray;
+
+// Like the list, the entries live outside the heap pages.
+typedef struct {
+  Obj obj;
+  ValueTable table;
+} ObjMap;
+
+typedef struct {
+  Obj obj;
+  ObjString* name;
+  Table methods;
+  ObjClosure* initializer; // the init method, NULL without one
+  int fieldCount; // the most fields an instance has had, to size new ones
+} ObjClass;
+
+// The fields are in the slots given by the shape, see shape.h. Like the
+// items of a list they are outside the heap pages.
+typedef struct {
+  Obj obj;
+  ObjClass* klass;
+  struct Shape* shape;
+  Value* fields;
+  int capacity;
+} ObjInstance;
+
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjClosure* method;
+} ObjBoundMethod;
+
+// A mutable buffer for assembling a string, see stringbuilder.c. Only
+// build() hashes and interns what has been appended.
+typedef struct {
+  Obj obj;
+  char* chars;
+  int length;
+  int capacity;
+} ObjStringBuilder;
+
 ObjString* copyString(const char* chars, int length);
 /* ObjString* copyStringNoVM(char* chars, int length); */
 /* ObjString* takeString(char* chars, int length); */
-void printObject(Value value);
+void printObject(FILE* out, Value value);
 uint32_t hashString(const char* str, int length);
 ObjFunction* newFunction();
 ObjClosure* newClosure(ObjFunction* function);
 ObjUpvalue* newUpvalue(Value* slot);
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(NativeFn function, const char* name, int arity);
+ObjList* newList();
+ObjFloatArray* newFloatArray(int count);
+ObjMap* newMap();
+ObjClass* newClass(ObjString* name);
+ObjInstance* newInstance(ObjClass* klass);
+ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjStringBuilder* newStringBuilder();
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
@@ -0,0 +1,573 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+// Peephole passes over the bytecode of one function. Still to do: an AST
+// front end with an SSA form for constant propagation across statements,
+// dataflow dead code elimination, common subexpression elimination and
+// loop invariant code motion, which the single pass compiler has no place
+// for.
+
+// The instructions of a chunk, decoded so that passes can delete and
+// rewrite them. Jumps refer to the index of their target instead of an
+// offset, and the direction is only chosen again when emitting.
+typedef struct {
+  uint8_t op;
+  int operand; // constant, slot, argument count, or jump target index
+  int line;
+  int bytes; // offset of the other operand bytes in the old code
+  int site; // the InlineSite of the chunk it belongs to, or -1
+  int inlinedLine;
+  bool target;
+  bool dead;
+} Instruction;
+
+typedef struct {
+  Chunk* chunk;
+  Instruction* code;
+  int count;
+  int capacity;
+} Function;
+
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP ||
+    op == OP_CHECK_CALLEE;
+}
+
+// Jumps that may fall through. They only jump forward.
+static bool isConditional(uint8_t op) {
+  return op == OP_JUMP_IF_FALSE || op == OP_CHECK_CALLEE;
+}
+
+static bool hasByteOperand(uint8_t op) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_PEEK:
+    case OP_POKE:
+    case OP_SLIDE:
+    case OP_GET_ENCLOSING:
+    case OP_SET_ENCLOSING:
+    case OP_GET_CAPTURED:
+    case OP_LIST:
+    case OP_MAP:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Bytes after the name constant: the argument count of an invoke and
+// the cache index.
+static int extraBytes(uint8_t op) {
+  switch (op) {
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      return 2;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+static int closureUpvalues(Chunk* chunk, int constant) {
+  return AS_FUNCTION(chunk->constants.values[constant])->upvalueCount;
+}
+
+static int instructionSize(Chunk* chunk, Instruction* instruction) {
+  if (instruction->op == OP_CHECK_CALLEE) return 5;
+  if (isJump(instruction->op)) return 3;
+  if (instruction->op == OP_CLOSURE) {
+    return 2 + 2 * closureUpvalues(chunk, instruction->operand);
+  }
+  return (hasByteOperand(instruction->op) ? 2 : 1) + extraBytes(instruction->op);
+}
+
+static void decode(Function* function) {
+  Chunk* chunk = function->chunk;
+  int* indexAt = ALLOCATE(int, chunk->count + 1);
+  function->capacity = chunk->count;
+  function->code = ALLOCATE(Instruction, function->capacity);
+  function->count = 0;
+
+  int run = 0;
+  for (int offset = 0; offset < chunk->count;) {
+    while (run + 1 < chunk->lines.count && chunk->lines.offsets[run + 1] <= offset) run++;
+
+    Instruction* instruction = &function->code[function->count];
+    instruction->op = chunk->code[offset];
+    instruction->line = chunk->lines.lines[run];
+    instruction->target = false;
+    instruction->dead = false;
+    instruction->bytes = offset + 1;
+    instruction->site = -1;
+    InlineSite* site = findInlineSite(chunk, offset);
+    if (site != NULL) {
+      instruction->site = (int)(site - chunk->inlines);
+      instruction->inlinedLine = inlinedLine(site, offset);
+    }
+
+    int size;
+    if (isJump(instruction->op)) {
+      size = instructionSize(chunk, instruction);
+      int jump = (chunk->code[offset + size - 2] << 8) | chunk->code[offset + size - 1];
+      // A target offset for now, turned into an index below.
+      instruction->operand = offset + size + (instruction->op == OP_LOOP ? -jump : jump);
+    } else {
+      if (instruction->op == OP_CLOSURE || hasByteOperand(instruction->op)) {
+        instruction->operand = chunk->code[offset + 1];
+        instruction->bytes = offset + 2;
+      }
+      size = instructionSize(chunk, instruction);
+    }
+
+    indexAt[offset] = function->count++;
+    offset += size;
+  }
+  indexAt[chunk->count] = function->count;
+
+  for (int i = 0; i < function->count; i++) {
+    Instruction* instruction = &function->code[i];
+    if (isJump(instruction->op)) instruction->operand = indexAt[instruction->operand];
+  }
+
+  FREE_ARRAY(int, indexAt, chunk->count + 1);
+}
+
+static void markTargets(Function* function) {
+  for (int i = 0; i < function->count; i++) {
+    function->code[i].target = false;
+  }
+  for (int i = 0; i < function->count; i++) {
+    Instruction* instruction = &function->code[i];
+    if (isJump(instruction->op) && instruction->operand < function->count) {
+      function->code[instruction->operand].target = true;
+    }
+  }
+}
+
+// Whether the instructions after the first of the count starting at index
+// exist and are only reached from it.
+static bool straight(Function* function, int index, int count) {
+  if (index + count > function->count) return false;
+  for (int i = index + 1; i < index + count; i++) {
+    if (function->code[i].target || function->code[i].dead) return false;
+  }
+  return true;
+}
+
+// The value an instruction pushes when it is a constant.
+static bool constantOf(Function* function, Instruction* instruction, Value* value) {
+  switch (instruction->op) {
+    case OP_NIL: *value = NIL_VAL; return true;
+    case OP_TRUE: *value = BOOL_VAL(true); return true;
+    case OP_FALSE: *value = BOOL_VAL(false); return true;
+    case OP_CONSTANT:
+      *value = function->chunk->constants.values[instruction->operand];
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool setConstant(Function* function, Instruction* instruction, Value value) {
+  if (IS_BOOL(value)) {
+    instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    return true;
+  }
+
+  int constant = addConstant(function->chunk, value);
+  if (constant > UINT8_MAX) return false;
+  instruction->op = OP_CONSTANT;
+  instruction->operand = constant;
+  return true;
+}
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Operations on constants. Operands that would make the operation fail
+// at runtime are left alone, so the error still happens.
+static bool foldConstants(Function* function) {
+  bool changed = false;
+
+  for (int i = 0; i < function->count; i++) {
+    Value a, b;
+    if (function->code[i].dead || !constantOf(function, &function->code[i], &a)) continue;
+
+    if (straight(function, i, 2)) {
+      uint8_t op = function->code[i + 1].op;
+      bool folded = false;
+      if (op == OP_NEGATE && IS_NUMBER(a)) {
+        folded = setConstant(function, &function->code[i], NUMBER_VAL(-AS_NUMBER(a)));
+      } else if (op == OP_NEGATE && IS_INT(a) && AS_INT(a) != INT64_MIN) {
+        folded = setConstant(function, &function->code[i], INT_VAL(-AS_INT(a)));
+      } else if (op == OP_BIT_NOT && IS_INT(a)) {
+        folded = setConstant(function, &function->code[i], INT_VAL(~AS_INT(a)));
+      } else if (op == OP_NOT) {
+        folded = setConstant(function, &function->code[i], BOOL_VAL(isFalsey(a)));
+      }
+      if (folded) {
+        function->code[i + 1].dead = true;
+        changed = true;
+        continue;
+      }
+    }
+
+    if (!straight(function, i, 3) ||
+        !constantOf(function, &function->code[i + 1], &b)) continue;
+
+    uint8_t op = function->code[i + 2].op;
+    Value result;
+    if (op == OP_EQUAL) {
+      result = BOOL_VAL(valuesEqual(a, b));
+    } else if (IS_INT(a) && IS_INT(b)) {
+      // Overflows, division and shifts are left to the VM.
+      int64_t x = AS_INT(a);
+      int64_t y = AS_INT(b);
+      int64_t z;
+      switch (op) {
+        case OP_ADD:
+          if (__builtin_add_overflow(x, y, &z)) continue;
+          result = INT_VAL(z);
+          break;
+        case OP_SUBTRACT:
+          if (__builtin_sub_overflow(x, y, &z)) continue;
+          result = INT_VAL(z);
+          break;
+        case OP_MULTIPLY:
+          if (__builtin_mul_overflow(x, y, &z)) continue;
+          result = INT_VAL(z);
+          break;
+        case OP_BIT_AND: result = INT_VAL(x & y); break;
+        case OP_BIT_OR: result = INT_VAL(x | y); break;
+        case OP_BIT_XOR: result = INT_VAL(x ^ y); break;
+        case OP_GREATER: result = BOOL_VAL(x > y); break;
+        case OP_LESS: result = BOOL_VAL(x < y); break;
+        default: continue;
+      }
+    } else if (IS_NUMERIC(a) && IS_NUMERIC(b)) {
+      double x = AS_FLOAT(a);
+      double y = AS_FLOAT(b);
+      switch (op) {
+        case OP_ADD: result = NUMBER_VAL(x + y); break;
+        case OP_SUBTRACT: result = NUMBER_VAL(x - y); break;
+        case OP_MULTIPLY: result = NUMBER_VAL(x * y); break;
+        case OP_DIVIDE: result = NUMBER_VAL(x / y); break;
+        case OP_GREATER: result = BOOL_VAL(x > y); break;
+        case OP_LESS: result = BOOL_VAL(x < y); break;
+        default: continue;
+      }
+    } else {
+      continue;
+    }
+
+    if (setConstant(function, &function->code[i], result)) {
+      function->code[i + 1].dead = true;
+      function->code[i + 2].dead = true;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+// Pushes that are popped right away, and a local read right after it was
+// assigned.
+static bool removeUselessPushes(Function* function) {
+  bool changed = false;
+
+  for (int i = 0; i < function->count; i++) {
+    Instruction* instruction = &function->code[i];
+    if (instruction->dead || !straight(function, i, 2)) continue;
+    Instruction* next = &function->code[i + 1];
+
+    switch (instruction->op) {
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+      case OP_CONSTANT:
+      case OP_GET_LOCAL:
+      case OP_GET_UPVALUE:
+      case OP_GET_ENCLOSING:
+      case OP_GET_CAPTURED:
+      case OP_PEEK:
+        if (next->op == OP_POP) {
+          instruction->dead = true;
+          next->dead = true;
+          changed = true;
+        }
+        break;
+      case OP_SET_LOCAL:
+        if (next->op == OP_POP && straight(function, i, 3) &&
+            function->code[i + 2].op == OP_GET_LOCAL &&
+            function->code[i + 2].operand == instruction->operand) {
+          next->dead = true;
+          function->code[i + 2].dead = true;
+          changed = true;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  return changed;
+}
+
+// Conditional jumps on a constant. OP_JUMP_IF_FALSE leaves the condition
+// on the stack either way, so a jump that is always taken becomes an
+// OP_JUMP and one that never is goes away.
+static bool foldBranches(Function* function) {
+  bool changed = false;
+
+  for (int i = 0; i < function->count; i++) {
+    Value condition;
+    if (function->code[i].dead || !straight(function, i, 2) ||
+        function->code[i + 1].op != OP_JUMP_IF_FALSE ||
+        !constantOf(function, &function->code[i], &condition)) continue;
+
+    if (isFalsey(condition)) {
+      function->code[i + 1].op = OP_JUMP;
+    } else {
+      function->code[i + 1].dead = true;
+    }
+    changed = true;
+  }
+
+  return changed;
+}
+
+// The next instruction that will run from index on.
+static int skipDead(Function* function, int index) {
+  while (index < function->count && function->code[index].dead) index++;
+  return index;
+}
+
+// Jumps to unconditional jumps go straight to the final target, and jumps
+// to the next instruction are removed. A conditional jump can also follow
+// one to the same condition. Conditional jumps must stay forward, there
+// are no backward ones.
+static bool threadJumps(Function* function) {
+  bool changed = false;
+
+  for (int i = 0; i < function->count; i++) {
+    Instruction* instruction = &function->code[i];
+    if (instruction->dead || !isJump(instruction->op)) continue;
+
+    for (int hops = 0; hops < 8; hops++) {
+      int target = skipDead(function, instruction->operand);
+      if (target >= function->count || target == i) break;
+      Instruction* next = &function->code[target];
+
+      int to = -1;
+      if (next->op == OP_JUMP || next->op == OP_LOOP) {
+        to = next->operand;
+      } else if (next->op == OP_JUMP_IF_FALSE && instruction->op == OP_JUMP_IF_FALSE) {
+        to = next->operand;
+      }
+      if (to == -1 || to == instruction->operand) break;
+      if (isConditional(instruction->op) && to <= i) break;
+
+      instruction->operand = to;
+      changed = true;
+    }
+
+    if (!isConditional(instruction->op) &&
+        skipDead(function, instruction->operand) == skipDead(function, i + 1)) {
+      instruction->dead = true;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+// Code that no jump reaches, like what follows a return.
+static bool removeUnreachable(Function* function) {
+  bool* reached = ALLOCATE(bool, function->count);
+  int* work = ALLOCATE(int, function->count);
+  int workCount = 0;
+  for (int i = 0; i < function->count; i++) reached[i] = false;
+
+  if (function->count > 0) {
+    reached[0] = true;
+    work[workCount++] = 0;
+  }
+
+  while (workCount > 0) {
+    int i = work[--workCount];
+    Instruction* instruction = &function->code[i];
+    int successors[2];
+    int count = 0;
+
+    if (isJump(instruction->op)) successors[count++] = instruction->operand;
+    if (instruction->op != OP_JUMP && instruction->op != OP_LOOP &&
+        instruction->op != OP_RETURN) {
+      successors[count++] = i + 1;
+    }
+
+    for (int s = 0; s < count; s++) {
+      int next = successors[s];
+      if (next < function->count && !reached[next]) {
+        reached[next] = true;
+        work[workCount++] = next;
+      }
+    }
+  }
+
+  bool changed = false;
+  for (int i = 0; i < function->count; i++) {
+    if (!reached[i] && !function->code[i].dead) {
+      function->code[i].dead = true;
+      changed = true;
+    }
+  }
+
+  FREE_ARRAY(bool, reached, function->count);
+  FREE_ARRAY(int, work, function->count);
+  return changed;
+}
+
+// Drops the dead instructions. A jump to a dead instruction goes to the
+// next live one, which is what would have run next.
+static void compact(Function* function) {
+  int* newIndex = ALLOCATE(int, function->count + 1);
+  int count = 0;
+  for (int i = 0; i < function->count; i++) {
+    newIndex[i] = count;
+    if (!function->code[i].dead) function->code[count++] = function->code[i];
+  }
+  newIndex[function->count] = count;
+
+  for (int i = 0; i < count; i++) {
+    Instruction* instruction = &function->code[i];
+    if (isJump(instruction->op)) instruction->operand = newIndex[instruction->operand];
+  }
+
+  FREE_ARRAY(int, newIndex, function->count + 1);
+  function->count = count;
+}
+
+static void emit(Function* function) {
+  Chunk* chunk = function->chunk;
+  int* offsets = ALLOCATE(int, function->count + 1);
+  int offset = 0;
+  for (int i = 0; i < function->count; i++) {
+    offsets[i] = offset;
+    offset += instructionSize(chunk, &function->code[i]);
+  }
+  offsets[function->count] = offset;
+
+  Chunk out;
+  initChunk(&out);
+  for (int i = 0; i < chunk->inlineCount; i++) {
+    addInlineSite(&out, chunk->inlines[i].function);
+  }
+  for (int i = 0; i < function->count; i++) {
+    Instruction* instruction = &function->code[i];
+    int line = instruction->line;
+    if (instruction->site != -1) {
+      markInlined(&out, instruction->site, instruction->inlinedLine);
+    }
+
+    if (isJump(instruction->op)) {
+      int from = offsets[i] + instructionSize(chunk, instruction);
+      int to = offsets[instruction->operand];
+      if (instruction->op == OP_CHECK_CALLEE) {
+        writeChunk(&out, instruction->op, line);
+        writeChunk(&out, chunk->code[instruction->bytes], line);
+        writeChunk(&out, chunk->code[instruction->bytes + 1], line);
+        writeChunk(&out, ((to - from) >> 8) & 0xff, line);
+        writeChunk(&out, (to - from) & 0xff, line);
+      } else if (to >= from) {
+        writeChunk(&out, instruction->op == OP_LOOP ? OP_JUMP : instruction->op, line);
+        writeChunk(&out, ((to - from) >> 8) & 0xff, line);
+        writeChunk(&out, (to - from) & 0xff, line);
+      } else {
+        writeChunk(&out, OP_LOOP, line);
+        writeChunk(&out, ((from - to) >> 8) & 0xff, line);
+        writeChunk(&out, (from - to) & 0xff, line);
+      }
+      continue;
+    }
+
+    writeChunk(&out, instruction->op, line);
+    if (instruction->op == OP_CLOSURE || hasByteOperand(instruction->op)) {
+      writeChunk(&out, instruction->operand, line);
+    }
+    for (int b = 0; b < extraBytes(instruction->op); b++) {
+      writeChunk(&out, chunk->code[instruction->bytes + b], line);
+    }
+    if (instruction->op == OP_CLOSURE) {
+      int bytes = 2 * closureUpvalues(chunk, instruction->operand);
+      for (int b = 0; b < bytes; b++) {
+        writeChunk(&out, chunk->code[instruction->bytes + b], line);
+      }
+    }
+  }
+  for (int i = 0; i < function->count; i++) {
+    int site = function->code[i].site;
+    if (site != -1) out.inlines[site].end = offsets[i + 1];
+  }
+
+  FREE_ARRAY(int, offsets, function->count + 1);
+
+  out.constants = chunk->constants;
+  initValueArray(&chunk->constants);
+  out.caches = chunk->caches;
+  out.cacheCount = chunk->cacheCount;
+  out.cacheCapacity = chunk->cacheCapacity;
+  chunk->caches = NULL;
+  chunk->cacheCapacity = 0;
+  freeChunk(chunk);
+  *chunk = out;
+}
+
+// Optimizes the bytecode of one function: folds constant expressions and
+// branches, threads jumps and removes unreachable code and pushes that
+// are popped right away. Runs after the function is compiled, see -O.
+void optimizeChunk(Chunk* chunk) {
+  // Jump threading can make a jump longer, and every jump fits when the
+  // whole chunk does.
+  if (chunk->count == 0 || chunk->count > UINT16_MAX) return;
+
+  Function function;
+  function.chunk = chunk;
+  decode(&function);
+
+  bool changed;
+  do {
+    changed = false;
+    markTargets(&function);
+    changed |= foldConstants(&function);
+    changed |= foldBranches(&function);
+    changed |= removeUselessPushes(&function);
+    changed |= threadJumps(&function);
+    changed |= removeUnreachable(&function);
+    compact(&function);
+  } while (changed);
+
+  emit(&function);
+  FREE_ARRAY(Instruction, function.code, function.capacity);
+}
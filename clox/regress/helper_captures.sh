@@ -0,0 +1,42 @@
+#!/bin/bash
+# Local helpers that do not escape, capturing this and enough locals that
+# endLocalFunction() jumps over their capture bytes, run with -O. The
+# optimizer decodes the jumped over bytes too. Build without the DEBUG_*
+# flags in common.h.
+cd "$(dirname "$0")/.."
+script=/tmp/clox_helper_captures.lox
+cat > $script <<'LOX'
+class A {
+  init() { this.y = 10; }
+  m() {
+    var x = 1;
+    fun h() { return x + this.y; }
+    var r = h();
+    print "after";
+    return r;
+  }
+}
+print A().m();
+
+fun many() {
+  var l0 = 0; var l1 = 1; var l2 = 2; var l3 = 3; var l4 = 4; var l5 = 5;
+  var l6 = 6; var l7 = 7; var l8 = 8; var l9 = 9; var l10 = 10; var l11 = 11;
+  var l12 = 12; var l13 = 13; var l14 = 14; var l15 = 15; var l16 = 16;
+  var l17 = 17;
+  fun h() { return l1 + l16 + l17; }
+  var r = h();
+  if (r > 0) r = r + 1;
+  return r;
+}
+print many();
+LOX
+expected=$'after\n11\n35'
+for mode in "" -O; do
+  actual=$(timeout 10 ./clox.sh $mode $script 2>&1)
+  if [ "$actual" != "$expected" ]; then
+    echo "FAIL ${mode:-plain}:"
+    echo "$actual"
+    exit 1
+  fi
+done
+echo ok
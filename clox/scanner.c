@@ -1,25 +1,106 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "common.h"
+#include "number.h"
 #include "scanner.h"
+#include "simd.h"
+
+// Input is read in chunks of this size when streaming.
+#define SCANNER_CHUNK (64 * 1024)
 
 typedef struct {
   const char* start;
   const char* current;
+  const char* end;
   int line;
+  size_t length;
+
+  // Streaming: the input read so far. Tokens point into these buffers,
+  // so they are only freed after compiling.
+  int fd;
+  bool eof;
+  char* limit;
+  Arena buffers;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
-void initScanner(const char* source) {
+// The source does not need a terminating '\0'.
+void initScanner(const char* source, size_t length) {
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + length;
   scanner.line = 1;
+  scanner.length = length;
+  scanner.fd = -1;
+  scanner.eof = true;
+  scanner.limit = NULL;
+  initArena(&scanner.buffers);
+}
+
+void initScannerStream(int fd) {
+  initScanner("", 0);
+  scanner.fd = fd;
+  scanner.eof = false;
+  scanner.limit = (char*)scanner.end;
+}
+
+// Length of the input seen so far.
+size_t scannedBytes() {
+  return scanner.length;
+}
+
+void setScannerLine(int line) {
+  scanner.line = line;
+}
+
+void freeScanner() {
+  freeArena(&scanner.buffers);
+}
+
+// Reads whatever the stream has ready, so a script can be compiled while
+// it is still being written. A token cut off at the end of a full buffer
+// is copied to the start of the next one.
+static bool refill() {
+  if (scanner.eof) return false;
+
+  if (scanner.end == scanner.limit) {
+    size_t kept = scanner.end - scanner.start;
+    size_t size = kept < SCANNER_CHUNK / 2 ? SCANNER_CHUNK : kept * 2;
+    char* buffer = ARENA_ALLOCATE(&scanner.buffers, char, size);
+    memcpy(buffer, scanner.start, kept);
+
+    scanner.current = buffer + (scanner.current - scanner.start);
+    scanner.start = buffer;
+    scanner.end = buffer + kept;
+    scanner.limit = buffer + size;
+  }
+
+  ssize_t count;
+  do {
+    count = read(scanner.fd, (char*)scanner.end, scanner.limit - scanner.end);
+  } while (count < 0 && errno == EINTR);
+
+  if (count < 0) {
+    fprintf(stderr, "Could not read script: %s.\n", strerror(errno));
+    exit(74);
+  }
+  if (count == 0) {
+    scanner.eof = true;
+    return false;
+  }
+  scanner.end += count;
+  scanner.length += count;
+  return true;
 }
 
 static bool isAtEnd() {
-    return *scanner.current == '\0';
+  return scanner.current >= scanner.end && !refill();
 }
 
 static Token makeToken(TokenType type) {
@@ -53,16 +134,137 @@ static bool match(char expected) {
 }
 
 static char peek() {
+  if (isAtEnd()) return '\0';
   return *scanner.current;
 }
 
 static char peekNext() {
-  if (isAtEnd()) return '\0';
+  while (scanner.current + 1 >= scanner.end) {
+    if (!refill()) return '\0';
+  }
   return scanner.current[1];
 }
 
+static bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+static bool isAlpha(char c) {
+  return (c >= 'a' && c <= 'z') ||
+         (c >= 'A' && c <= 'Z') ||
+          c == '_';
+}
+
+// The fast paths below consume whole blocks of bytes while at least a
+// block is buffered and leave the rest to the byte loops, which also do
+// the refilling when streaming. Most runs are short, so the first few
+// bytes are still checked one at a time: a block costs more than that.
+// Without SIMD the helpers do nothing.
+#define SCAN_SHORT_RUN 8
+
+#ifdef SIMD_WIDTH
+static bool isBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static void countLines(uint32_t newlines) {
+  scanner.line += __builtin_popcount(newlines);
+}
+#endif
+
+// Skips spaces, tabs and newlines.
+static void skipBlanks() {
+#ifdef SIMD_WIDTH
+  const char* current = scanner.current;
+  for (int i = 0; i < SCAN_SHORT_RUN; i++, current++) {
+    if (current == scanner.end || !isBlank(*current)) {
+      scanner.current = current;
+      return;
+    }
+    if (*current == '\n') scanner.line++;
+  }
+
+  while (scanner.end - current >= SIMD_WIDTH) {
+    SimdBytes bytes = simdLoad(current);
+    uint32_t newlines = simdEqual(bytes, '\n');
+    uint32_t blanks = newlines | simdEqual(bytes, ' ') |
+      simdEqual(bytes, '\t') | simdEqual(bytes, '\r');
+    if (blanks != SIMD_ALL) {
+      int count = __builtin_ctz(~blanks);
+      countLines(newlines & ((1u << count) - 1));
+      current += count;
+      break;
+    }
+    countLines(newlines);
+    current += SIMD_WIDTH;
+  }
+  scanner.current = current;
+#endif
+}
+
+// Skips to the end of the line, or to the next of the stop character.
+// Newlines on the way are counted when the stop character is not '\n'.
+static void skipUntil(char stop) {
+#ifdef SIMD_WIDTH
+  const char* current = scanner.current;
+  for (int i = 0; i < SCAN_SHORT_RUN; i++, current++) {
+    if (current == scanner.end || *current == stop) {
+      scanner.current = current;
+      return;
+    }
+    if (*current == '\n') scanner.line++;
+  }
+
+  while (scanner.end - current >= SIMD_WIDTH) {
+    SimdBytes bytes = simdLoad(current);
+    uint32_t newlines = simdEqual(bytes, '\n');
+    uint32_t stops = stop == '\n' ? newlines : simdEqual(bytes, stop);
+    if (stops != 0) {
+      int count = __builtin_ctz(stops);
+      if (stop != '\n') countLines(newlines & ((1u << count) - 1));
+      current += count;
+      break;
+    }
+    if (stop != '\n') countLines(newlines);
+    current += SIMD_WIDTH;
+  }
+  scanner.current = current;
+#endif
+}
+
+// Skips letters, digits and '_', or only digits.
+static void skipWord(bool digitsOnly) {
+#ifdef SIMD_WIDTH
+  const char* current = scanner.current;
+  for (int i = 0; i < SCAN_SHORT_RUN; i++, current++) {
+    if (current == scanner.end ||
+        !(isDigit(*current) || (!digitsOnly && isAlpha(*current)))) {
+      scanner.current = current;
+      return;
+    }
+  }
+
+  while (scanner.end - current >= SIMD_WIDTH) {
+    SimdBytes bytes = simdLoad(current);
+    uint32_t word = simdInRange(bytes, '0', '9');
+    if (!digitsOnly) {
+      word |= simdInRange(simdOr(bytes, 0x20), 'a', 'z') | simdEqual(bytes, '_');
+    }
+    if (word != SIMD_ALL) {
+      current += __builtin_ctz(~word);
+      break;
+    }
+    current += SIMD_WIDTH;
+  }
+  scanner.current = current;
+#endif
+}
+
 static void skipWhitespace() {
   for (;;) {
+    skipBlanks();
+    // Whitespace is not part of the next token, refill() need not keep it.
+    scanner.start = scanner.current;
     char c = peek();
     switch (c) {
     case ' ':
@@ -77,6 +279,7 @@ static void skipWhitespace() {
     case '/':
       if (peekNext() == '/') {
         // A comment goes until the end of the line.
+        skipUntil('\n');
         while (peek() != '\n' && !isAtEnd()) advance();
       } else {
         return;
@@ -89,6 +292,7 @@ static void skipWhitespace() {
 }
 
 static Token string() {
+  skipUntil('"');
   while (peek() != '"' && !isAtEnd()) {
     if (peek() == '\n') scanner.line++;
       advance();
@@ -100,26 +304,24 @@ static Token string() {
   return makeToken(TOKEN_STRING);
 }
 
-static bool isDigit(char c) {
-  return c >= '0' && c <= '9';
-}
-
 static Token number() {
+  skipWord(true);
   while (isDigit(peek())) advance();
     // Look for a fractional part.
     if (peek() == '.' && isDigit(peekNext())) {
 
     // Consume the ".".
     advance();
+    skipWord(true);
     while (isDigit(peek())) advance();
+  } else {
+    Token token = makeToken(TOKEN_INTEGER);
+    if (parseInteger(token.start, token.length, &token.integer)) return token;
   }
-  return makeToken(TOKEN_NUMBER);
-}
 
-static bool isAlpha(char c) {
-  return (c >= 'a' && c <= 'z') ||
-         (c >= 'A' && c <= 'Z') ||
-          c == '_';
+  Token token = makeToken(TOKEN_NUMBER);
+  token.number = parseNumber(token.start, token.length);
+  return token;
 }
 
 static TokenType checkKeyword(int start, int length,
@@ -167,6 +369,7 @@ static TokenType identifierType() {
 }
 
 static Token identifier() {
+  skipWord(false);
   while (isAlpha(peek()) || isDigit(peek())) advance();
   return makeToken(identifierType());
 }
@@ -185,13 +388,20 @@ Token scanToken() {
     case ')': return makeToken(TOKEN_RIGHT_PAREN);
     case '{': return makeToken(TOKEN_LEFT_BRACE);
     case '}': return makeToken(TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(TOKEN_RIGHT_BRACKET);
     case ';': return makeToken(TOKEN_SEMICOLON);
+    case ':': return makeToken(TOKEN_COLON);
     case ',': return makeToken(TOKEN_COMMA);
     case '.': return makeToken(TOKEN_DOT);
     case '-': return makeToken(TOKEN_MINUS);
     case '+': return makeToken(TOKEN_PLUS);
     case '/': return makeToken(TOKEN_SLASH);
     case '*': return makeToken(TOKEN_STAR);
+    case '&': return makeToken(TOKEN_AMPERSAND);
+    case '|': return makeToken(TOKEN_PIPE);
+    case '^': return makeToken(TOKEN_CARET);
+    case '~': return makeToken(TOKEN_TILDE);
     case '!':
       return makeToken(
         match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
@@ -199,9 +409,11 @@ Token scanToken() {
       return makeToken(
         match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
     case '<':
+      if (match('<')) return makeToken(TOKEN_LESS_LESS);
       return makeToken(
         match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
+      if (match('>')) return makeToken(TOKEN_GREATER_GREATER);
       return makeToken(
         match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '"': return string();
@@ -1,20 +1,26 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
+
+#include <stddef.h>
+#include <stdint.h>
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
+  TOKEN_AMPERSAND, TOKEN_PIPE, TOKEN_CARET, TOKEN_TILDE,
 
   // One or two character tokens.
   TOKEN_BANG, TOKEN_BANG_EQUAL,
   TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
   TOKEN_GREATER, TOKEN_GREATER_EQUAL,
   TOKEN_LESS, TOKEN_LESS_EQUAL,
+  TOKEN_LESS_LESS, TOKEN_GREATER_GREATER,
 
   // Literals.
-  TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+  TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER, TOKEN_INTEGER,
 
   // Keywords.
   TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
@@ -29,9 +35,15 @@ typedef struct {
   const char* start;
   int length;
   int line;
+  double number; // the value of a TOKEN_NUMBER
+  int64_t integer; // the value of a TOKEN_INTEGER
 } Token;
 
-void initScanner(const char* source);
+void initScanner(const char* source, size_t length);
+void initScannerStream(int fd);
+void setScannerLine(int line);
+size_t scannedBytes();
+void freeScanner();
 Token scanToken();
 
 #endif
@@ -0,0 +1,52 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "shape.h"
+
+Shape* newShape(Shape* parent, ObjString* name) {
+  Shape* shape = ALLOCATE(Shape, 1);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  shape->children = NULL;
+  shape->childCount = 0;
+  shape->childCapacity = 0;
+  return shape;
+}
+
+// Frees the whole subtree.
+void freeShape(Shape* shape) {
+  for (int i = 0; i < shape->childCount; i++) {
+    freeShape(shape->children[i]);
+  }
+  FREE_ARRAY(Shape*, shape->children, shape->childCapacity);
+  FREE(Shape, shape);
+}
+
+// Names are interned, so they are compared by address. Only runs when a
+// property cache misses.
+int shapeSlot(Shape* shape, ObjString* name) {
+  for (; shape->name != NULL; shape = shape->parent) {
+    if (shape->name == name) return shape->fieldCount - 1;
+  }
+  return -1;
+}
+
+// The shape after adding the field, made on the first transition. The
+// name is kept alive by the shape tree, see markRoots().
+Shape* shapeAddField(Shape* shape, ObjString* name) {
+  for (int i = 0; i < shape->childCount; i++) {
+    if (shape->children[i]->name == name) return shape->children[i];
+  }
+
+  if (shape->childCapacity < shape->childCount + 1) {
+    int oldCapacity = shape->childCapacity;
+    shape->childCapacity = oldCapacity < 2 ? 2 : oldCapacity * 2;
+    shape->children = GROW_ARRAY(Shape*, shape->children,
+        oldCapacity, shape->childCapacity);
+  }
+
+  Shape* child = newShape(shape, name);
+  shape->children[shape->childCount++] = child;
+  return child;
+}
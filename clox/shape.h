@@ -0,0 +1,29 @@
+#ifndef clox_shape_h
+#define clox_shape_h
+
+#include "common.h"
+#include "object.h"
+
+// A hidden class: the fields of an instance and the slot of each. Instances
+// that got the same fields in the same order share a shape, so the slot of
+// a field is found once per shape instead of once per access, see the
+// property caches in vm.c. Shapes form a tree from vm.rootShape, a child
+// adding one field to its parent. They are plain memory outside the heap
+// and live until freeVM(), which keeps their addresses stable for caches.
+typedef struct Shape Shape;
+
+struct Shape {
+  Shape* parent;
+  ObjString* name; // the field added to the parent, NULL in the root
+  int fieldCount; // the field added is in slot fieldCount - 1
+  Shape** children;
+  int childCount;
+  int childCapacity;
+};
+
+Shape* newShape(Shape* parent, ObjString* name);
+void freeShape(Shape* shape);
+int shapeSlot(Shape* shape, ObjString* name);
+Shape* shapeAddField(Shape* shape, ObjString* name);
+
+#endif
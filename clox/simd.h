@@ -0,0 +1,113 @@
+#ifndef clox_simd_h
+#define clox_simd_h
+
+#include <stdint.h>
+
+// Byte-wise compares over a block of SIMD_WIDTH bytes, returning one bit
+// per byte, and arithmetic on SIMD_DOUBLES doubles at a time. AVX2 is
+// used when the compiler targets it (-mavx2), SSE2 otherwise on x86-64.
+// Without either SIMD_WIDTH and SIMD_DOUBLES are undefined and callers
+// keep to their scalar loops.
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define SIMD_WIDTH 32
+#define SIMD_ALL 0xffffffffu
+
+typedef __m256i SimdBytes;
+
+static inline SimdBytes simdLoad(const char* pointer) {
+  return _mm256_loadu_si256((const __m256i*)pointer);
+}
+
+static inline uint32_t simdEqual(SimdBytes bytes, char c) {
+  return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(c)));
+}
+
+static inline uint32_t simdInRange(SimdBytes bytes, char low, char high) {
+  __m256i offset = _mm256_sub_epi8(bytes, _mm256_set1_epi8(low));
+  __m256i limit = _mm256_set1_epi8((char)(high - low));
+  return (uint32_t)_mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(_mm256_min_epu8(offset, limit), offset));
+}
+
+static inline SimdBytes simdOr(SimdBytes bytes, char c) {
+  return _mm256_or_si256(bytes, _mm256_set1_epi8(c));
+}
+
+static inline uint32_t simdSame(SimdBytes a, SimdBytes b) {
+  return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+}
+
+#define SIMD_DOUBLES 4
+
+typedef __m256d SimdDoubles;
+
+static inline SimdDoubles simdLoadDoubles(const double* pointer) {
+  return _mm256_loadu_pd(pointer);
+}
+
+static inline void simdStoreDoubles(double* pointer, SimdDoubles values) {
+  _mm256_storeu_pd(pointer, values);
+}
+
+static inline SimdDoubles simdSplat(double value) { return _mm256_set1_pd(value); }
+static inline SimdDoubles simdAdd(SimdDoubles a, SimdDoubles b) { return _mm256_add_pd(a, b); }
+static inline SimdDoubles simdMul(SimdDoubles a, SimdDoubles b) { return _mm256_mul_pd(a, b); }
+static inline SimdDoubles simdMin(SimdDoubles a, SimdDoubles b) { return _mm256_min_pd(a, b); }
+static inline SimdDoubles simdMax(SimdDoubles a, SimdDoubles b) { return _mm256_max_pd(a, b); }
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define SIMD_WIDTH 16
+#define SIMD_ALL 0xffffu
+
+typedef __m128i SimdBytes;
+
+static inline SimdBytes simdLoad(const char* pointer) {
+  return _mm_loadu_si128((const __m128i*)pointer);
+}
+
+static inline uint32_t simdEqual(SimdBytes bytes, char c) {
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+}
+
+// low <= byte <= high, as unsigned bytes.
+static inline uint32_t simdInRange(SimdBytes bytes, char low, char high) {
+  __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(low));
+  __m128i limit = _mm_set1_epi8((char)(high - low));
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(_mm_min_epu8(offset, limit), offset));
+}
+
+static inline SimdBytes simdOr(SimdBytes bytes, char c) {
+  return _mm_or_si128(bytes, _mm_set1_epi8(c));
+}
+
+// One bit per byte equal in both blocks.
+static inline uint32_t simdSame(SimdBytes a, SimdBytes b) {
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+}
+
+#define SIMD_DOUBLES 2
+
+typedef __m128d SimdDoubles;
+
+static inline SimdDoubles simdLoadDoubles(const double* pointer) {
+  return _mm_loadu_pd(pointer);
+}
+
+static inline void simdStoreDoubles(double* pointer, SimdDoubles values) {
+  _mm_storeu_pd(pointer, values);
+}
+
+static inline SimdDoubles simdSplat(double value) { return _mm_set1_pd(value); }
+static inline SimdDoubles simdAdd(SimdDoubles a, SimdDoubles b) { return _mm_add_pd(a, b); }
+static inline SimdDoubles simdMul(SimdDoubles a, SimdDoubles b) { return _mm_mul_pd(a, b); }
+static inline SimdDoubles simdMin(SimdDoubles a, SimdDoubles b) { return _mm_min_pd(a, b); }
+static inline SimdDoubles simdMax(SimdDoubles a, SimdDoubles b) { return _mm_max_pd(a, b); }
+
+#endif
+
+#endif
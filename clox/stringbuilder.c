@@ -0,0 +1,77 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "stringbuilder.h"
+#include "vm.h"
+
+// Makes room for length more bytes. The buffer at least doubles when it
+// grows, so appending n bytes in pieces copies O(n) bytes in all, where
+// concatenating the pieces with + copies the string so far every time.
+static void reserve(ObjStringBuilder* builder, int length) {
+  int needed = builder->length + length;
+  if (needed <= builder->capacity) return;
+
+  int capacity = builder->capacity < 16 ? 16 : builder->capacity;
+  while (capacity < needed) capacity *= 2;
+  builder->chars = GROW_ARRAY(char, builder->chars, builder->capacity, capacity);
+  builder->capacity = capacity;
+}
+
+static void appendChars(ObjStringBuilder* builder, const char* chars, int length) {
+  reserve(builder, length);
+  memcpy(builder->chars + builder->length, chars, length);
+  builder->length += length;
+}
+
+static bool stringBuilderNative(int argCount, Value* args, Value* result) {
+  *result = OBJ_VAL(newStringBuilder());
+  return true;
+}
+
+// Returns the builder, so appends can be chained.
+static bool appendNative(int argCount, Value* args, Value* result) {
+  if (!IS_STRING_BUILDER(args[0]) || !IS_STRING(args[1])) {
+    runtimeError("append() takes a string builder and a string.");
+    return false;
+  }
+  ObjString* string = AS_STRING(args[1]);
+  appendChars(AS_STRING_BUILDER(args[0]), string->chars, string->length);
+  *result = args[0];
+  return true;
+}
+
+// Formatted like print formats numbers.
+static bool appendNumberNative(int argCount, Value* args, Value* result) {
+  if (!IS_STRING_BUILDER(args[0]) || !IS_NUMERIC(args[1])) {
+    runtimeError("appendNumber() takes a string builder and a number.");
+    return false;
+  }
+  char buffer[32];
+  int length = IS_INT(args[1])
+    ? snprintf(buffer, sizeof(buffer), "%" PRId64, AS_INT(args[1]))
+    : snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(args[1]));
+  appendChars(AS_STRING_BUILDER(args[0]), buffer, length);
+  *result = args[0];
+  return true;
+}
+
+// The builder can still be appended to afterwards.
+static bool buildNative(int argCount, Value* args, Value* result) {
+  if (!IS_STRING_BUILDER(args[0])) {
+    runtimeError("build() takes a string builder.");
+    return false;
+  }
+  ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+  *result = OBJ_VAL(copyString(builder->length > 0 ? builder->chars : "", builder->length));
+  return true;
+}
+
+void defineStringBuilderNatives() {
+  defineNative("stringBuilder", stringBuilderNative, 0);
+  defineNative("append", appendNative, 2);
+  defineNative("appendNumber", appendNumberNative, 2);
+  defineNative("build", buildNative, 1);
+}
@@ -0,0 +1,6 @@
+#ifndef clox_stringbuilder_h
+#define clox_stringbuilder_h
+
+void defineStringBuilderNatives();
+
+#endif
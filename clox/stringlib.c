@@ -0,0 +1,159 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "simd.h"
+#include "stringlib.h"
+#include "vm.h"
+
+// The kernels look at SIMD_WIDTH bytes at a time and finish with a
+// scalar tail, like the scanner's skips.
+
+// The first index at or after from where needle starts in chars, -1 if
+// there is none. A block is only compared byte by byte where both the
+// first and the last byte of needle match, which on text rules out nearly
+// every position.
+static int findKernel(const char* chars, int length, const char* needle,
+                      int needleLength, int from) {
+  if (needleLength == 0) return from;
+  char first = needle[0];
+  char last = needle[needleLength - 1];
+  int i = from;
+#ifdef SIMD_WIDTH
+  for (; i + needleLength - 1 + SIMD_WIDTH <= length; i += SIMD_WIDTH) {
+    uint32_t candidates = simdEqual(simdLoad(chars + i), first) &
+      simdEqual(simdLoad(chars + i + needleLength - 1), last);
+    while (candidates != 0) {
+      int bit = __builtin_ctz(candidates);
+      if (memcmp(chars + i + bit, needle, needleLength) == 0) return i + bit;
+      candidates &= candidates - 1;
+    }
+  }
+#endif
+  for (; i + needleLength <= length; i++) {
+    if (chars[i] == first && memcmp(chars + i, needle, needleLength) == 0) return i;
+  }
+  return -1;
+}
+
+// The first index where a and b differ, count if they don't.
+static int mismatchKernel(const char* a, const char* b, int count) {
+  int i = 0;
+#ifdef SIMD_WIDTH
+  for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH) {
+    uint32_t same = simdSame(simdLoad(a + i), simdLoad(b + i));
+    if (same != SIMD_ALL) return i + __builtin_ctz(~same);
+  }
+#endif
+  for (; i < count; i++) {
+    if (a[i] != b[i]) return i;
+  }
+  return count;
+}
+
+static bool indexOfNative(int argCount, Value* args, Value* result) {
+  if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError("indexOf() takes two strings.");
+    return false;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* needle = AS_STRING(args[1]);
+  *result = INT_VAL(findKernel(string->chars, string->length,
+                               needle->chars, needle->length, 0));
+  return true;
+}
+
+// Every piece is kept, so n separators give n + 1 pieces, some of them
+// maybe empty.
+static bool splitNative(int argCount, Value* args, Value* result) {
+  if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError("split() takes two strings.");
+    return false;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* separator = AS_STRING(args[1]);
+  if (separator->length == 0) {
+    runtimeError("Can't split by an empty string.");
+    return false;
+  }
+
+  // The list and each piece stay on the stack while the next allocation
+  // may collect.
+  ObjList* list = newList();
+  push(OBJ_VAL(list));
+  int start = 0;
+  for (;;) {
+    int end = findKernel(string->chars, string->length,
+                         separator->chars, separator->length, start);
+    int pieceEnd = end < 0 ? string->length : end;
+    push(OBJ_VAL(copyString(string->chars + start, pieceEnd - start)));
+    writeValueArray(&list->items, vm.stack[vm.stackSize - 1]);
+    pop();
+    if (end < 0) break;
+    start = end + separator->length;
+  }
+  *result = pop();
+  return true;
+}
+
+// The characters from start up to but not including end.
+static bool substringNative(int argCount, Value* args, Value* result) {
+  if (!IS_STRING(args[0]) || !IS_INT(args[1]) || !IS_INT(args[2])) {
+    runtimeError("substring() takes a string and two integers.");
+    return false;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  int64_t start = AS_INT(args[1]);
+  int64_t end = AS_INT(args[2]);
+  if (start < 0 || start > end || end > string->length) {
+    runtimeError("Substring %" PRId64 "..%" PRId64 " out of range 0..%d.",
+                 start, end, string->length);
+    return false;
+  }
+  *result = OBJ_VAL(copyString(string->chars + start, (int)(end - start)));
+  return true;
+}
+
+// -1, 0 or 1 as a sorts before, with or after b, byte by byte.
+static bool compareNative(int argCount, Value* args, Value* result) {
+  if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError("compare() takes two strings.");
+    return false;
+  }
+  ObjString* a = AS_STRING(args[0]);
+  ObjString* b = AS_STRING(args[1]);
+  // Strings are interned, equal ones are the same object.
+  if (a == b) {
+    *result = INT_VAL(0);
+    return true;
+  }
+  int shorter = a->length < b->length ? a->length : b->length;
+  int i = mismatchKernel(a->chars, b->chars, shorter);
+  if (i < shorter) {
+    *result = INT_VAL((uint8_t)a->chars[i] < (uint8_t)b->chars[i] ? -1 : 1);
+  } else {
+    *result = INT_VAL(a->length < b->length ? -1 : 1);
+  }
+  return true;
+}
+
+static bool startsWithNative(int argCount, Value* args, Value* result) {
+  if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+    runtimeError("startsWith() takes two strings.");
+    return false;
+  }
+  ObjString* string = AS_STRING(args[0]);
+  ObjString* prefix = AS_STRING(args[1]);
+  *result = BOOL_VAL(prefix->length <= string->length &&
+      mismatchKernel(string->chars, prefix->chars, prefix->length) == prefix->length);
+  return true;
+}
+
+void defineStringNatives() {
+  defineNative("indexOf", indexOfNative, 2);
+  defineNative("split", splitNative, 2);
+  defineNative("substring", substringNative, 3);
+  defineNative("compare", compareNative, 2);
+  defineNative("startsWith", startsWithNative, 2);
+}
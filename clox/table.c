@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -129,8 +130,105 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
 void tableRemoveWhite(Table* table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry entry = table->entries[i];
-    if (!(entry.key == NULL || entry.key->obj.isMarked)) {
+    if (!(entry.key == NULL || heapIsMarked(entry.key))) {
       tableDelete(table, entry.key);
     }
   }
 }
+
+bool isHashable(Value value) {
+  return !IS_OBJ(value) || IS_STRING(value);
+}
+
+// The capacity is a power of two.
+static MapEntry* findMapEntry(MapEntry* entries, int capacity, Value key) {
+  uint32_t index = hashValue(key) & (capacity - 1);
+  MapEntry* tombstone = NULL;
+
+  for (;;) {
+    MapEntry* entry = &entries[index];
+    if (IS_NO_KEY(entry->key)) {
+      if (IS_NIL(entry->value)) {
+        return tombstone != NULL ? tombstone : entry;
+      }
+      if (tombstone == NULL) tombstone = entry;
+    } else if (valuesEqual(entry->key, key)) {
+      return entry;
+    }
+
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void adjustMapCapacity(ValueTable* table, int capacity) {
+  MapEntry* entries = ALLOCATE(MapEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NO_KEY;
+    entries[i].value = NIL_VAL;
+  }
+
+  for (int i = 0; i < table->capacity; i++) {
+    MapEntry* entry = &table->entries[i];
+    if (IS_NO_KEY(entry->key)) continue;
+    MapEntry* dest = findMapEntry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+  }
+  table->used = table->count;
+
+  FREE_ARRAY(MapEntry, table->entries, table->capacity);
+  table->entries = entries;
+  table->capacity = capacity;
+}
+
+void initValueTable(ValueTable* table) {
+  table->count = 0;
+  table->used = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+void freeValueTable(ValueTable* table) {
+  FREE_ARRAY(MapEntry, table->entries, table->capacity);
+  initValueTable(table);
+}
+
+// The key must be hashable.
+bool valueTableSet(ValueTable* table, Value key, Value value) {
+  if (table->used + 1 > table->capacity * TABLE_LOAD_MAX) {
+    adjustMapCapacity(table, GROW_CAPACITY(table->capacity));
+  }
+
+  MapEntry* entry = findMapEntry(table->entries, table->capacity, key);
+  bool isNewKey = IS_NO_KEY(entry->key);
+  if (isNewKey) {
+    table->count++;
+    if (IS_NIL(entry->value)) table->used++;
+  }
+
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+bool valueTableGet(ValueTable* table, Value key, Value* value) {
+  if (table->count == 0) return false;
+
+  MapEntry* entry = findMapEntry(table->entries, table->capacity, key);
+  if (IS_NO_KEY(entry->key)) return false;
+
+  *value = entry->value;
+  return true;
+}
+
+bool valueTableDelete(ValueTable* table, Value key) {
+  if (table->count == 0) return false;
+
+  MapEntry* entry = findMapEntry(table->entries, table->capacity, key);
+  if (IS_NO_KEY(entry->key)) return false;
+
+  entry->key = NO_KEY;
+  entry->value = BOOL_VAL(true);
+  table->count--;
+  return true;
+}
@@ -15,6 +15,23 @@ typedef struct {
   Entry* entries;
 } Table;
 
+typedef struct {
+  Value key;
+  Value value;
+} MapEntry;
+
+// Keyed by any hashable Value, for ObjMap. Free entries have NO_KEY as
+// the key, and tombstones true as the value.
+typedef struct {
+  int count; // live entries
+  int used; // live entries and tombstones
+  int capacity;
+  MapEntry* entries;
+} ValueTable;
+
+#define NO_KEY OBJ_VAL(NULL)
+#define IS_NO_KEY(value) (IS_OBJ(value) && AS_OBJ(value) == NULL)
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableSet(Table* table, ObjString* key, Value value);
@@ -24,4 +41,11 @@ void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 void tableRemoveWhite(Table* table);
 
+bool isHashable(Value value);
+void initValueTable(ValueTable* table);
+void freeValueTable(ValueTable* table);
+bool valueTableSet(ValueTable* table, Value key, Value value);
+bool valueTableGet(ValueTable* table, Value key, Value* value);
+bool valueTableDelete(ValueTable* table, Value key);
+
 #endif
@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -28,26 +29,73 @@ void freeValueArray(ValueArray* array) {
     initValueArray(array);
 }
 
+// Exact, unlike converting the int: 2^53 + 1 is not 2^53.
+static bool intEqualsDouble(int64_t integer, double number) {
+  return (double)integer == number && number < 0x1p63 &&
+         (int64_t)number == integer;
+}
+
 bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type) return false;
+  if (a.type != b.type) {
+    if (IS_INT(a) && IS_NUMBER(b)) return intEqualsDouble(AS_INT(a), AS_NUMBER(b));
+    if (IS_NUMBER(a) && IS_INT(b)) return intEqualsDouble(AS_INT(b), AS_NUMBER(a));
+    return false;
+  }
 
   switch (a.type) {
     case VAL_NIL: return true;
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_INT: return AS_INT(a) == AS_INT(b);
     case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
     default: return false;
   }
 }
 
+// The finalizer of MurmurHash3.
+static uint32_t hashBits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  bits *= 0xc4ceb9fe1a85ec53ull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// Values that are equal hash the same, 1 and 1.0 too. Of the objects only
+// strings can be hashed, see isHashable() in table.c.
+uint32_t hashValue(Value value) {
+  switch (value.type) {
+    case VAL_NIL: return 0x9e3779b9u;
+    case VAL_BOOL: return AS_BOOL(value) ? 1231 : 1237;
+    case VAL_INT: return hashBits((uint64_t)AS_INT(value));
+    case VAL_NUMBER: {
+      double number = AS_NUMBER(value);
+      if (number >= -0x1p63 && number < 0x1p63 && number == (double)(int64_t)number) {
+        return hashBits((uint64_t)(int64_t)number);
+      }
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      return hashBits(bits);
+    }
+    case VAL_OBJ: return AS_STRING(value)->hash;
+  }
+  return 0;
+}
+
 void printValue(Value value) {
+  fprintValue(stdout, value);
+}
+
+void fprintValue(FILE* out, Value value) {
   switch(value.type) {
     case VAL_BOOL:
-      printf(AS_BOOL(value) ? "true" : "false");
+      fprintf(out, AS_BOOL(value) ? "true" : "false");
       break;
-    case VAL_NIL: printf("nil"); break;
-    case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-    case VAL_OBJ: printObject(value); break;
+    case VAL_NIL: fprintf(out, "nil"); break;
+    case VAL_NUMBER: fprintf(out, "%g", AS_NUMBER(value)); break;
+    case VAL_INT: fprintf(out, "%" PRId64, AS_INT(value)); break;
+    case VAL_OBJ: printObject(out, value); break;
   }
 }
 
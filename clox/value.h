@@ -1,6 +1,8 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <stdio.h>
+
 #include "common.h"
 
 typedef struct Obj Obj;
@@ -10,6 +12,7 @@ typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
+  VAL_INT,
   VAL_OBJ,
 } ValueType;
 
@@ -18,6 +21,7 @@ typedef struct {
   union {
     bool boolean;
     double number;
+    int64_t integer;
     Obj* obj;
   } as;
 } Value;
@@ -25,16 +29,24 @@ typedef struct {
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
 #define AS_OBJ(value)     ((value).as.obj)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(value)    ((Value){VAL_OBJ, {.obj = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
+#define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)(object)}})
+
+// Either kind of number. AS_FLOAT converts an int to a double.
+#define IS_NUMERIC(value) (IS_INT(value) || IS_NUMBER(value))
+#define AS_FLOAT(value) \
+  (IS_INT(value) ? (double)AS_INT(value) : AS_NUMBER(value))
 
 typedef struct {
    int capacity;
@@ -47,6 +59,7 @@ void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
+void fprintValue(FILE* out, Value value);
 bool valuesEqual(Value a, Value b);
 uint32_t hashValue(Value value);
 
@@ -1,62 +1,189 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <inttypes.h>
 
 #include "vm.h"
 #include "common.h"
 #include "debug.h"
 #include "memory.h"
 #include "compiler.h"
+#include "floatarray.h"
+#include "stringbuilder.h"
+#include "stringlib.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-VM vm;
+_Thread_local VM vm;
 
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(int argCount, Value* args, Value* result) {
+  *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static bool pushNative(int argCount, Value* args, Value* result) {
+  if (!IS_LIST(args[0])) {
+    runtimeError("push() takes a list.");
+    return false;
+  }
+  writeValueArray(&AS_LIST(args[0])->items, args[1]);
+  *result = NIL_VAL;
+  return true;
+}
+
+static bool popNative(int argCount, Value* args, Value* result) {
+  if (!IS_LIST(args[0])) {
+    runtimeError("pop() takes a list.");
+    return false;
+  }
+  ValueArray* items = &AS_LIST(args[0])->items;
+  if (items->count == 0) {
+    runtimeError("Can't pop from an empty list.");
+    return false;
+  }
+  *result = items->values[--items->count];
+  return true;
+}
+
+static bool lenNative(int argCount, Value* args, Value* result) {
+  if (IS_LIST(args[0])) {
+    *result = INT_VAL(AS_LIST(args[0])->items.count);
+  } else if (IS_FLOAT_ARRAY(args[0])) {
+    *result = INT_VAL(AS_FLOAT_ARRAY(args[0])->count);
+  } else if (IS_STRING(args[0])) {
+    *result = INT_VAL(AS_STRING(args[0])->length);
+  } else if (IS_MAP(args[0])) {
+    *result = INT_VAL(AS_MAP(args[0])->table.count);
+  } else if (IS_STRING_BUILDER(args[0])) {
+    *result = INT_VAL(AS_STRING_BUILDER(args[0])->length);
+  } else {
+    runtimeError("len() takes a list, a float array, a string, a map or a string builder.");
+    return false;
+  }
+  return true;
+}
+
+static bool checkMapKey(Value key) {
+  if (!isHashable(key)) {
+    runtimeError("Map keys must be numbers, strings, booleans or nil.");
+    return false;
+  }
+  // NaN is not equal to itself, an entry under it could never be found.
+  if (IS_NUMBER(key) && isnan(AS_NUMBER(key))) {
+    runtimeError("Map keys can't be NaN.");
+    return false;
+  }
+  return true;
+}
+
+static bool hasNative(int argCount, Value* args, Value* result) {
+  if (!IS_MAP(args[0])) {
+    runtimeError("has() takes a map.");
+    return false;
+  }
+  Value value;
+  *result = BOOL_VAL(isHashable(args[1]) &&
+      valueTableGet(&AS_MAP(args[0])->table, args[1], &value));
+  return true;
+}
+
+static bool deleteNative(int argCount, Value* args, Value* result) {
+  if (!IS_MAP(args[0])) {
+    runtimeError("delete() takes a map.");
+    return false;
+  }
+  *result = BOOL_VAL(isHashable(args[1]) &&
+      valueTableDelete(&AS_MAP(args[0])->table, args[1]));
+  return true;
+}
+
+static bool keysNative(int argCount, Value* args, Value* result) {
+  if (!IS_MAP(args[0])) {
+    runtimeError("keys() takes a map.");
+    return false;
+  }
+  ValueTable* table = &AS_MAP(args[0])->table;
+  // The keys are allocated before the list, a collection while allocating
+  // them cannot see the list.
+  Value* items = GROW_ARRAY(Value, NULL, 0, table->count);
+  int count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (!IS_NO_KEY(table->entries[i].key)) items[count++] = table->entries[i].key;
+  }
+  ObjList* list = newList();
+  list->items.values = items;
+  list->items.capacity = table->count;
+  list->items.count = count;
+  *result = OBJ_VAL(list);
+  return true;
 }
 
 static void resetStack() {
-  FREE_ARRAY(Value, vm.stack, vm.stackCapasity);
+  // Both grown with plain realloc() by growStack(), so not counted in
+  // vm.bytesAllocated either.
+  free(vm.stack);
+  free(vm.openUpvalues);
+  vm.stack = NULL;
+  vm.openUpvalues = NULL;
+  vm.openTop = 0;
   vm.stackSize = 0;
   vm.stackCapasity = 0;
   vm.frameCount = 0;
-  vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vfprintf(vm.err, format, args);
   va_end(args);
-  fputs("\n", stderr);
+  fputs("\n", vm.err);
 
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
+    InlineSite* site = findInlineSite(&function->chunk, instruction);
+    if (site != NULL) {
+      ObjFunction* inlined = AS_FUNCTION(function->chunk.constants.values[site->function]);
+      fprintf(vm.err, "[line %d] in %s()\n",
+          inlinedLine(site, instruction), inlined->name->chars);
+    }
     int line = getLine(&function->chunk, instruction);
-    fprintf(stderr, "[line %d] in ", line);
+    fprintf(vm.err, "[line %d] in ", line);
     if (function->name == NULL) {
-      fprintf(stderr, "script\n");
+      fprintf(vm.err, "script\n");
     } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+      fprintf(vm.err, "%s()\n", function->name->chars);
     }
   }
   resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function) {
+void defineNative(const char* name, NativeFn function, int arity) {
   push(OBJ_VAL(copyString(name, (int)(strlen(name)))));
-  push(OBJ_VAL(newNative(function)));
+  push(OBJ_VAL(newNative(function, name, arity)));
   tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
   pop();
   pop();
 }
 
+static void defineNatives() {
+  defineNative("clock", clockNative, 0);
+  defineNative("push", pushNative, 2);
+  defineNative("pop", popNative, 1);
+  defineNative("len", lenNative, 1);
+  defineNative("has", hasNative, 2);
+  defineNative("delete", deleteNative, 2);
+  defineNative("keys", keysNative, 1);
+  defineFloatArrayNatives();
+  defineStringBuilderNatives();
+  defineStringNatives();
+}
+
 static Value peek(int distance) {
   return vm.stack[vm.stackSize - 1 - distance];
 }
@@ -66,8 +193,8 @@ static bool isFalsey(Value val) {
 }
 
 static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
+  ObjString* b = AS_STRING(peek(0));
+  ObjString* a = AS_STRING(peek(1));
   int length = a->length + b->length;
   char* chars = ALLOCATE(char, length + 1);
   memcpy(chars, a->chars, a->length);
@@ -76,10 +203,82 @@ static void concatenate() {
 
   ObjString* result = copyString(chars, length);
   FREE_ARRAY(char, chars, length + 1);
+  pop();
+  pop();
   push(OBJ_VAL(result));
 }
 
+static bool checkIndex(Value index, int count, int* slot) {
+  if (!IS_INT(index)) {
+    runtimeError("Index must be an integer.");
+    return false;
+  }
+  int64_t i = AS_INT(index);
+  if (i < 0 || i >= count) {
+    runtimeError("Index %" PRId64 " out of range 0..%d.", i, count - 1);
+    return false;
+  }
+  *slot = (int)i;
+  return true;
+}
+
+static bool indexGet(Value target, Value index, Value* result) {
+  int slot;
+  if (IS_LIST(target)) {
+    ObjList* list = AS_LIST(target);
+    if (!checkIndex(index, list->items.count, &slot)) return false;
+    *result = list->items.values[slot];
+    return true;
+  }
+  if (IS_FLOAT_ARRAY(target)) {
+    ObjFloatArray* array = AS_FLOAT_ARRAY(target);
+    if (!checkIndex(index, array->count, &slot)) return false;
+    *result = NUMBER_VAL(array->values[slot]);
+    return true;
+  }
+  if (IS_MAP(target)) {
+    if (!checkMapKey(index)) return false;
+    // A missing key reads as nil.
+    if (!valueTableGet(&AS_MAP(target)->table, index, result)) *result = NIL_VAL;
+    return true;
+  }
+  runtimeError("Can only index lists, float arrays and maps.");
+  return false;
+}
+
+static bool indexSet(Value target, Value index, Value value) {
+  int slot;
+  if (IS_LIST(target)) {
+    ObjList* list = AS_LIST(target);
+    if (!checkIndex(index, list->items.count, &slot)) return false;
+    list->items.values[slot] = value;
+    return true;
+  }
+  if (IS_FLOAT_ARRAY(target)) {
+    ObjFloatArray* array = AS_FLOAT_ARRAY(target);
+    if (!checkIndex(index, array->count, &slot)) return false;
+    if (!IS_NUMERIC(value)) {
+      runtimeError("Float array elements must be numbers.");
+      return false;
+    }
+    array->values[slot] = AS_FLOAT(value);
+    return true;
+  }
+  if (IS_MAP(target)) {
+    if (!checkMapKey(index)) return false;
+    valueTableSet(&AS_MAP(target)->table, index, value);
+    return true;
+  }
+  runtimeError("Can only index lists, float arrays and maps.");
+  return false;
+}
+
 static bool call(ObjClosure* closure, int argCount) {
+  if (closure->function->lazy != NULL && !compileLazy(closure->function)) {
+    runtimeError("Could not compile %s.", closure->function->name->chars);
+    return false;
+  }
+
   if (closure->function->arity != argCount) {
     runtimeError("%s got %d arguments, expected %d.\n",
       closure->function->name->chars, argCount,
@@ -106,14 +305,37 @@ static bool callValue(Value callee, int argCount) {
       case OBJ_CLOSURE:
         return call(AS_CLOSURE(callee), argCount);
         break;
+      case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm.stack[vm.stackSize - argCount - 1] = bound->receiver;
+        return call(bound->method, argCount);
+      }
+      case OBJ_CLASS: {
+        ObjClass* klass = AS_CLASS(callee);
+        ObjInstance* instance = newInstance(klass);
+        vm.stack[vm.stackSize - argCount - 1] = OBJ_VAL(instance);
+        if (klass->initializer != NULL) return call(klass->initializer, argCount);
+        if (argCount != 0) {
+          runtimeError("%s got %d arguments, expected 0.", klass->name->chars, argCount);
+          return false;
+        }
+        return true;
+      }
       case OBJ_NATIVE: {
-        NativeFn function = AS_NATIVE(callee)->function;
-        Value args[argCount];
-        for (int i = argCount - 1; i >= 0; i--) {
-          args[i] = pop();
+        ObjNative* native = AS_NATIVE(callee);
+        if (native->arity != -1 && native->arity != argCount) {
+          runtimeError("%s got %d arguments, expected %d.",
+              native->name, argCount, native->arity);
+          return false;
+        }
+        // The arguments stay on the stack while the native runs, so they
+        // survive a collection if it allocates.
+        Value result;
+        if (!native->function(argCount, &vm.stack[vm.stackSize - argCount], &result)) {
+          return false;
         }
-        vm.stackSize--; // otetaan funktio pois pinosta;
-        push(function(argCount, args));
+        vm.stackSize -= argCount + 1; // otetaan funktio pois pinosta;
+        push(result);
         return true;
         break;
       }
@@ -125,39 +347,156 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
-  ObjUpvalue* prevUpvalue = NULL;
-  ObjUpvalue* upvalue = vm.openUpvalues;
+// Replaces the instance on top of the stack with its method bound to it.
+static bool bindMethod(ObjClass* klass, ObjString* name) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+  vm.stack[vm.stackSize - 1] = OBJ_VAL(bound);
+  return true;
+}
 
-  while (upvalue != NULL && upvalue->location > local) {
-    prevUpvalue = upvalue;
-    upvalue = upvalue->next;
+static void defineMethod(ObjString* name) {
+  Value method = peek(0);
+  ObjClass* klass = AS_CLASS(peek(1));
+  tableSet(&klass->methods, name, method);
+  if (name->length == 4 && memcmp(name->chars, "init", 4) == 0) {
+    klass->initializer = AS_CLOSURE(method);
   }
+  pop();
+}
 
-  if (upvalue != NULL && upvalue->location == local) {
-    return upvalue;
+static CacheEntry* findCacheEntry(PropertyCache* cache, Shape* shape) {
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    if (cache->entries[i].shape == shape) return &cache->entries[i];
   }
+  return NULL;
+}
 
-  ObjUpvalue* createdUpvalue = newUpvalue(local);
-  createdUpvalue->next = upvalue;
+// Overwrites the oldest entry once all are in use.
+static void addCacheEntry(PropertyCache* cache, Shape* shape, Shape* next, int slot) {
+  CacheEntry* entry = &cache->entries[cache->count++ % CACHE_WAYS];
+  entry->shape = shape;
+  entry->next = next;
+  entry->slot = slot;
+}
 
-  if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
-  } else {
-    prevUpvalue->next = createdUpvalue;
+// The slow path of OP_GET_PROPERTY: the field, or else a method bound to
+// the instance.
+static bool getProperty(ObjInstance* instance, ObjString* name, PropertyCache* cache) {
+  int slot = shapeSlot(instance->shape, name);
+  if (slot == -1) return bindMethod(instance->klass, name);
+
+  addCacheEntry(cache, instance->shape, instance->shape, slot);
+  vm.stack[vm.stackSize - 1] = instance->fields[slot];
+  return true;
+}
+
+// The slow path of OP_SET_PROPERTY. A new field moves the instance to the
+// next shape and may need room for one more slot.
+static void setProperty(ObjInstance* instance, ObjString* name, PropertyCache* cache) {
+  Shape* shape = instance->shape;
+  int slot = shapeSlot(shape, name);
+  Shape* next = slot == -1 ? shapeAddField(shape, name) : shape;
+  if (slot == -1) slot = next->fieldCount - 1;
+  addCacheEntry(cache, shape, next, slot);
+}
+
+// Gives the instance the fields of next. The fields array is grown before
+// the shape changes, a collection meanwhile sees the old fields.
+static void growFields(ObjInstance* instance, Shape* next) {
+  if (next->fieldCount > instance->capacity) {
+    int capacity = instance->capacity < 4 ? 4 : instance->capacity * 2;
+    instance->fields = GROW_ARRAY(Value, instance->fields, instance->capacity, capacity);
+    instance->capacity = capacity;
+  }
+  if (next->fieldCount > instance->klass->fieldCount) {
+    instance->klass->fieldCount = next->fieldCount;
+  }
+  instance->shape = next;
+}
+
+// Invoke caches are keyed by the class of the receiver. OP_INVOKE also
+// gives the shape, an instance of which has no field of the name.
+static ObjClosure* findCachedMethod(PropertyCache* cache, ObjClass* klass, Shape* shape) {
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if (entry->klass == (Obj*)klass && entry->shape == shape) {
+      return (ObjClosure*)entry->method;
+    }
+  }
+  return NULL;
+}
+
+static bool invokeFromClass(ObjClass* klass, Shape* shape, ObjString* name,
+    int argCount, PropertyCache* cache) {
+  ObjClosure* method = findCachedMethod(cache, klass, shape);
+  if (method == NULL) {
+    Value value;
+    if (!tableGet(&klass->methods, name, &value)) {
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
+    }
+    method = AS_CLOSURE(value);
+    CacheEntry* entry = &cache->entries[cache->count++ % CACHE_WAYS];
+    entry->shape = shape;
+    entry->klass = (Obj*)klass;
+    entry->method = (Obj*)method;
+  }
+  return call(method, argCount);
+}
+
+// A method call with the receiver and the arguments on the stack. The
+// method gets its frame right away, no bound method is made. A field of
+// the name holding a function is called instead.
+static bool invoke(ObjString* name, int argCount, PropertyCache* cache) {
+  Value receiver = peek(argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have methods.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  ObjClosure* method = findCachedMethod(cache, instance->klass, instance->shape);
+  if (method != NULL) return call(method, argCount);
+
+  int slot = shapeSlot(instance->shape, name);
+  if (slot != -1) {
+    Value value = instance->fields[slot];
+    vm.stack[vm.stackSize - argCount - 1] = value;
+    return callValue(value, argCount);
   }
+  return invokeFromClass(instance->klass, instance->shape, name, argCount, cache);
+}
 
-  return createdUpvalue;
+// Open upvalues are kept per stack slot, so finding the one of a slot
+// does not depend on how many other variables are captured.
+static ObjUpvalue* captureUpvalue(int slot) {
+  ObjUpvalue* upvalue = vm.openUpvalues[slot];
+  if (upvalue != NULL) return upvalue;
+
+  upvalue = newUpvalue(&vm.stack[slot]);
+  vm.openUpvalues[slot] = upvalue;
+  if (slot >= vm.openTop) vm.openTop = slot + 1;
+  return upvalue;
 }
 
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL &&
-         vm.openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    upvalue->closed = *upvalue->location;
+// Closes the upvalues of slots from last on. Only the slots below
+// openTop are looked at, a return from a frame without captured
+// variables does nothing.
+static void closeUpvalues(int last) {
+  for (int slot = last; slot < vm.openTop; slot++) {
+    ObjUpvalue* upvalue = vm.openUpvalues[slot];
+    if (upvalue == NULL) continue;
+    upvalue->closed = vm.stack[slot];
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    vm.openUpvalues[slot] = NULL;
   }
+  if (last < vm.openTop) vm.openTop = last;
 }
 
 static InterpretResult run() {
@@ -172,16 +511,94 @@ static InterpretResult run() {
 #define READ_SHORT() \
   (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8 | frame->ip[-1])))
 
-#define BINARY_OP(valueType, op) \
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+// Rewrites the instruction being run. A specialized one that misses goes
+// back to the generic op and runs that instead.
+#define QUICKEN(op) (frame->ip[-1] = (op))
+#define DEOPTIMIZE(op) \
+  do { \
+    frame->ip[-1] = (op); \
+    frame->ip--; \
+  } while (false)
+
+// Replaces the two operands of a binary op with its result.
+#define BINARY_RESULT(value) \
+  do { \
+    vm.stackSize--; \
+    vm.stack[vm.stackSize - 1] = (value); \
+  } while (false)
+
+// Two ints give an int unless the result overflows, any other two
+// numbers a double.
+#define ARITHMETIC_OP(op, checked, intOp, numberOp) \
+  do { \
+    Value b = peek(0); \
+    Value a = peek(1); \
+    int64_t result; \
+    if (IS_INT(a) && IS_INT(b) && !checked(AS_INT(a), AS_INT(b), &result)) { \
+      QUICKEN(intOp); \
+      BINARY_RESULT(INT_VAL(result)); \
+    } else if (IS_NUMERIC(a) && IS_NUMERIC(b)) { \
+      if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(numberOp); \
+      BINARY_RESULT(NUMBER_VAL(AS_FLOAT(a) op AS_FLOAT(b))); \
+    } else { \
+      runtimeError("Operands must be numbers."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+  } while (false)
+
+#define COMPARISON_OP(op, intOp, numberOp) \
   do { \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+    Value b = peek(0); \
+    Value a = peek(1); \
+    if (IS_INT(a) && IS_INT(b)) { \
+      QUICKEN(intOp); \
+      BINARY_RESULT(BOOL_VAL(AS_INT(a) op AS_INT(b))); \
+    } else if (IS_NUMERIC(a) && IS_NUMERIC(b)) { \
+      if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(numberOp); \
+      BINARY_RESULT(BOOL_VAL(AS_FLOAT(a) op AS_FLOAT(b))); \
+    } else { \
       runtimeError("Operands must be numbers."); \
       return INTERPRET_RUNTIME_ERROR; \
     } \
-    double b = AS_NUMBER(pop()); \
-    double a = AS_NUMBER(pop()); \
-    push(valueType(a op b)); \
-  } while(false)
+  } while (false)
+
+// result is an expression of the ints a and b.
+#define BITWISE_OP(result) \
+  do { \
+    if (!IS_INT(peek(0)) || !IS_INT(peek(1))) { \
+      runtimeError("Operands must be integers."); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+    int64_t b = AS_INT(pop()); \
+    int64_t a = AS_INT(pop()); \
+    push(INT_VAL(result)); \
+  } while (false)
+
+// The quickened ops take only the operand types they were written for.
+#define QUICK_INT_OP(checked, genericOp) \
+  do { \
+    Value b = peek(0); \
+    Value a = peek(1); \
+    int64_t result; \
+    if (IS_INT(a) && IS_INT(b) && !checked(AS_INT(a), AS_INT(b), &result)) { \
+      BINARY_RESULT(INT_VAL(result)); \
+    } else { \
+      DEOPTIMIZE(genericOp); \
+    } \
+  } while (false)
+
+#define QUICK_OP(is, as, valueType, op, genericOp) \
+  do { \
+    Value b = peek(0); \
+    Value a = peek(1); \
+    if (is(a) && is(b)) { \
+      BINARY_RESULT(valueType(as(a) op as(b))); \
+    } else { \
+      DEOPTIMIZE(genericOp); \
+    } \
+  } while (false)
 
 #ifdef DEBUG_TRACE_EXECUTION
     int previousLine = 0;
@@ -204,7 +621,7 @@ static InterpretResult run() {
         switch (instruction = READ_BYTE()) {
           case OP_RETURN: {
             Value result = pop();
-            closeUpvalues(&vm.stack[frame->slot]);
+            closeUpvalues(frame->slot);
             vm.frameCount--;
             if (vm.frameCount == 0) {
               pop();
@@ -221,14 +638,15 @@ static InterpretResult run() {
               break;
           }
           case OP_PRINT: {
-            printValue(pop());
-            printf("\n");
+            fprintValue(vm.out, pop());
+            fputc('\n', vm.out);
             break;
           }
           case OP_POP: pop(); break;
           case OP_DEFINE_GLOBAL: {
             ObjString* name = READ_STRING();
-            tableSet(&vm.globals, name, pop());
+            tableSet(&vm.globals, name, peek(0));
+            pop();
             break;
           }
           case OP_GET_GLOBAL: {
@@ -273,6 +691,8 @@ static InterpretResult run() {
           case OP_LOOP: {
             uint16_t offset = READ_SHORT();
             frame->ip -= offset;
+            // Safepoint: no object pointers are held outside the VM.
+            if (vm.compactPending) compactHeap();
             break;
           }
           case OP_CALL: {
@@ -281,6 +701,37 @@ static InterpretResult run() {
               return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frameCount - 1];
+            if (vm.compactPending) compactHeap();
+            break;
+          }
+          // The callee of an inlined call must still be the function whose
+          // body follows, the slow path after it does the real call.
+          case OP_CHECK_CALLEE: {
+            uint8_t argCount = READ_BYTE();
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            uint16_t offset = READ_SHORT();
+            Value callee = peek(argCount);
+            if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function != function) {
+              frame->ip += offset;
+            }
+            break;
+          }
+          case OP_PEEK: {
+            uint8_t distance = READ_BYTE();
+            push(peek(distance));
+            break;
+          }
+          case OP_POKE: {
+            uint8_t distance = READ_BYTE();
+            vm.stack[vm.stackSize - 1 - distance] = peek(0);
+            break;
+          }
+          // Leaves only the top value of the count below it.
+          case OP_SLIDE: {
+            uint8_t count = READ_BYTE();
+            Value result = peek(0);
+            vm.stackSize -= count;
+            vm.stack[vm.stackSize - 1] = result;
             break;
           }
           case OP_CLOSURE: {
@@ -288,13 +739,22 @@ static InterpretResult run() {
             ObjClosure* closure = newClosure(function);
             push(OBJ_VAL(closure));
             for (int i = 0; i < closure->upvalueCount; i++) {
-              uint8_t isLocal = READ_BYTE();
+              uint8_t kind = READ_BYTE();
               uint8_t index = READ_BYTE();
-              if (isLocal) {
-                closure->upvalues[i] =
-                  captureUpvalue(&vm.stack[frame->slot + index]);
-              } else {
-                closure->upvalues[i] = frame->closure->upvalues[index];
+              switch (kind) {
+                case CAPTURE_LOCAL:
+                  closure->upvalues[i] =
+                    captureUpvalue(frame->slot + index);
+                  break;
+                case CAPTURE_UPVALUE:
+                  closure->upvalues[i] = frame->closure->upvalues[index];
+                  break;
+                case CAPTURE_LOCAL_VALUE:
+                  closure->values[i] = vm.stack[frame->slot + index];
+                  break;
+                case CAPTURE_VALUE:
+                  closure->values[i] = frame->closure->values[index];
+                  break;
               }
             }
             break;
@@ -304,23 +764,45 @@ static InterpretResult run() {
             push(*frame->closure->upvalues[slot]->location);
             break;
           }
+          case OP_GET_CAPTURED: {
+            uint8_t slot = READ_BYTE();
+            push(frame->closure->values[slot]);
+            break;
+          }
           case OP_SET_UPVALUE: {
             uint8_t slot = READ_BYTE();
             *frame->closure->upvalues[slot]->location = peek(0);
             break;
           }
+          // A local function that does not escape runs right above the
+          // frame of the function that declared it.
+          case OP_GET_ENCLOSING: {
+            uint8_t slot = READ_BYTE();
+            push(vm.stack[vm.frames[vm.frameCount - 2].slot + slot]);
+            break;
+          }
+          case OP_SET_ENCLOSING: {
+            uint8_t slot = READ_BYTE();
+            vm.stack[vm.frames[vm.frameCount - 2].slot + slot] = peek(0);
+            break;
+          }
           case OP_CLOSE_UPVALUE: {
-            closeUpvalues(&vm.stack[vm.stackSize - 1]);
+            closeUpvalues(vm.stackSize - 1);
             pop();
             break;
           }
-          case OP_NEGATE:
-            if (!IS_NUMBER(peek(0))) {
+          case OP_NEGATE: {
+            Value a = pop();
+            if (IS_INT(a) && AS_INT(a) != INT64_MIN) {
+              push(INT_VAL(-AS_INT(a)));
+            } else if (IS_NUMERIC(a)) {
+              push(NUMBER_VAL(-AS_FLOAT(a)));
+            } else {
               runtimeError("Operand must be number.");
               return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
             break;
+          }
           case OP_NIL: push(NIL_VAL); break;
           case OP_TRUE: push(BOOL_VAL(true)); break;
           case OP_FALSE: push(BOOL_VAL(false)); break;
@@ -328,68 +810,294 @@ static InterpretResult run() {
             push(BOOL_VAL(isFalsey(pop())));
             break;
           case OP_EQUAL: {
+            if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+              QUICKEN(OP_EQUAL_INT);
+            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+              QUICKEN(OP_EQUAL_NUM);
+            }
             Value a = pop();
             Value b = pop();
             push(BOOL_VAL(valuesEqual(a, b)));
             break;
           }
-          case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-          case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
+          case OP_GREATER: COMPARISON_OP(>, OP_GREATER_INT, OP_GREATER_NUM); break;
+          case OP_LESS: COMPARISON_OP(<, OP_LESS_INT, OP_LESS_NUM); break;
           case OP_ADD: {
             if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+              QUICKEN(OP_ADD_STR);
               concatenate();
-            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) { \
-              double b = AS_NUMBER(pop());
-              double a = AS_NUMBER(pop());
-              push(NUMBER_VAL(a + b));
+            } else if (IS_NUMERIC(peek(0)) && IS_NUMERIC(peek(1))) {
+              ARITHMETIC_OP(+, __builtin_add_overflow, OP_ADD_INT, OP_ADD_NUM);
             } else {
               runtimeError("Operands must be two strings or two numbers.");
               return INTERPRET_RUNTIME_ERROR;
             }
             break;
           }
-          case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-          case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-          case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
+          case OP_SUBTRACT:
+            ARITHMETIC_OP(-, __builtin_sub_overflow, OP_SUBTRACT_INT, OP_SUBTRACT_NUM);
+            break;
+          case OP_MULTIPLY:
+            ARITHMETIC_OP(*, __builtin_mul_overflow, OP_MULTIPLY_INT, OP_MULTIPLY_NUM);
+            break;
+          case OP_DIVIDE: {
+            Value b = peek(0);
+            Value a = peek(1);
+            if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) {
+              runtimeError("Operands must be numbers.");
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            // Stays an int only when it divides evenly, 7 / 2 is 3.5.
+            if (IS_INT(a) && IS_INT(b) && AS_INT(b) != 0 &&
+                !(AS_INT(a) == INT64_MIN && AS_INT(b) == -1) &&
+                AS_INT(a) % AS_INT(b) == 0) {
+              BINARY_RESULT(INT_VAL(AS_INT(a) / AS_INT(b)));
+            } else {
+              BINARY_RESULT(NUMBER_VAL(AS_FLOAT(a) / AS_FLOAT(b)));
+            }
+            break;
+          }
+          case OP_BIT_AND: BITWISE_OP(a & b); break;
+          case OP_BIT_OR: BITWISE_OP(a | b); break;
+          case OP_BIT_XOR: BITWISE_OP(a ^ b); break;
+          // Only the low six bits of the count are used, like in Java.
+          case OP_SHIFT_LEFT: BITWISE_OP((int64_t)((uint64_t)a << (b & 63))); break;
+          case OP_SHIFT_RIGHT: BITWISE_OP(a >> (b & 63)); break;
+          case OP_BIT_NOT:
+            if (!IS_INT(peek(0))) {
+              runtimeError("Operand must be an integer.");
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            push(INT_VAL(~AS_INT(pop())));
+            break;
+          case OP_LIST: {
+            uint8_t count = READ_BYTE();
+            ObjList* list = newList();
+            // The elements stay on the stack until they are in the list.
+            push(OBJ_VAL(list));
+            if (count > 0) {
+              list->items.values = GROW_ARRAY(Value, NULL, 0, count);
+              list->items.capacity = count;
+              memcpy(list->items.values, &vm.stack[vm.stackSize - 1 - count],
+                  sizeof(Value) * count);
+              list->items.count = count;
+            }
+            vm.stackSize -= count + 1;
+            push(OBJ_VAL(list));
+            break;
+          }
+          case OP_MAP: {
+            uint8_t count = READ_BYTE();
+            ObjMap* map = newMap();
+            // Like OP_LIST, the entries stay on the stack until inserted.
+            push(OBJ_VAL(map));
+            Value* entries = &vm.stack[vm.stackSize - 1 - 2 * count];
+            for (int i = 0; i < count; i++) {
+              if (!checkMapKey(entries[2 * i])) return INTERPRET_RUNTIME_ERROR;
+              valueTableSet(&map->table, entries[2 * i], entries[2 * i + 1]);
+            }
+            vm.stackSize -= 2 * count + 1;
+            push(OBJ_VAL(map));
+            break;
+          }
+          case OP_CLASS:
+            push(OBJ_VAL(newClass(READ_STRING())));
+            break;
+          case OP_INHERIT: {
+            Value superclass = peek(1);
+            if (!IS_CLASS(superclass)) {
+              runtimeError("Superclass must be a class.");
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjClass* subclass = AS_CLASS(peek(0));
+            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            subclass->initializer = AS_CLASS(superclass)->initializer;
+            pop();
+            break;
+          }
+          case OP_METHOD:
+            defineMethod(READ_STRING());
+            break;
+          // Instances whose shape the cache has seen skip the lookup.
+          case OP_GET_PROPERTY: {
+            ObjString* name = READ_STRING();
+            PropertyCache* cache = READ_CACHE();
+            if (!IS_INSTANCE(peek(0))) {
+              runtimeError("Only instances have properties.");
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjInstance* instance = AS_INSTANCE(peek(0));
+            CacheEntry* entry = findCacheEntry(cache, instance->shape);
+            if (entry != NULL) {
+              vm.stack[vm.stackSize - 1] = instance->fields[entry->slot];
+            } else if (!getProperty(instance, name, cache)) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+          }
+          case OP_SET_PROPERTY: {
+            ObjString* name = READ_STRING();
+            PropertyCache* cache = READ_CACHE();
+            if (!IS_INSTANCE(peek(1))) {
+              runtimeError("Only instances have fields.");
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjInstance* instance = AS_INSTANCE(peek(1));
+            CacheEntry* entry = findCacheEntry(cache, instance->shape);
+            if (entry == NULL) {
+              setProperty(instance, name, cache);
+              entry = findCacheEntry(cache, instance->shape);
+            }
+            if (entry->next != instance->shape) growFields(instance, entry->next);
+            instance->fields[entry->slot] = peek(0);
+            Value value = pop();
+            vm.stack[vm.stackSize - 1] = value;
+            break;
+          }
+          case OP_GET_SUPER: {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(pop());
+            if (!bindMethod(superclass, name)) return INTERPRET_RUNTIME_ERROR;
+            break;
+          }
+          case OP_INVOKE: {
+            ObjString* name = READ_STRING();
+            uint8_t argCount = READ_BYTE();
+            PropertyCache* cache = READ_CACHE();
+            if (!invoke(name, argCount, cache)) return INTERPRET_RUNTIME_ERROR;
+            frame = &vm.frames[vm.frameCount - 1];
+            if (vm.compactPending) compactHeap();
+            break;
+          }
+          case OP_SUPER_INVOKE: {
+            ObjString* name = READ_STRING();
+            uint8_t argCount = READ_BYTE();
+            PropertyCache* cache = READ_CACHE();
+            ObjClass* superclass = AS_CLASS(pop());
+            if (!invokeFromClass(superclass, NULL, name, argCount, cache)) {
+              return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            if (vm.compactPending) compactHeap();
+            break;
+          }
+          case OP_INDEX_GET: {
+            Value result;
+            if (!indexGet(peek(1), peek(0), &result)) return INTERPRET_RUNTIME_ERROR;
+            BINARY_RESULT(result);
+            break;
+          }
+          case OP_INDEX_SET: {
+            Value value = peek(0);
+            if (!indexSet(peek(2), peek(1), value)) return INTERPRET_RUNTIME_ERROR;
+            vm.stackSize -= 2;
+            vm.stack[vm.stackSize - 1] = value;
+            break;
+          }
+          case OP_ADD_NUM: QUICK_OP(IS_NUMBER, AS_NUMBER, NUMBER_VAL, +, OP_ADD); break;
+          case OP_SUBTRACT_NUM: QUICK_OP(IS_NUMBER, AS_NUMBER, NUMBER_VAL, -, OP_SUBTRACT); break;
+          case OP_MULTIPLY_NUM: QUICK_OP(IS_NUMBER, AS_NUMBER, NUMBER_VAL, *, OP_MULTIPLY); break;
+          case OP_ADD_STR:
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+              DEOPTIMIZE(OP_ADD);
+              break;
+            }
+            concatenate();
+            break;
+          case OP_EQUAL_NUM: QUICK_OP(IS_NUMBER, AS_NUMBER, BOOL_VAL, ==, OP_EQUAL); break;
+          case OP_GREATER_NUM: QUICK_OP(IS_NUMBER, AS_NUMBER, BOOL_VAL, >, OP_GREATER); break;
+          case OP_LESS_NUM: QUICK_OP(IS_NUMBER, AS_NUMBER, BOOL_VAL, <, OP_LESS); break;
+          case OP_ADD_INT: QUICK_INT_OP(__builtin_add_overflow, OP_ADD); break;
+          case OP_SUBTRACT_INT: QUICK_INT_OP(__builtin_sub_overflow, OP_SUBTRACT); break;
+          case OP_MULTIPLY_INT: QUICK_INT_OP(__builtin_mul_overflow, OP_MULTIPLY); break;
+          case OP_EQUAL_INT: QUICK_OP(IS_INT, AS_INT, BOOL_VAL, ==, OP_EQUAL); break;
+          case OP_GREATER_INT: QUICK_OP(IS_INT, AS_INT, BOOL_VAL, >, OP_GREATER); break;
+          case OP_LESS_INT: QUICK_OP(IS_INT, AS_INT, BOOL_VAL, <, OP_LESS); break;
         }
     }
 
 #undef READ_BYTE
 #undef READ_CONSTANT
-#undef BINARY_OP
 #undef READ_SHORT
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef BINARY_RESULT
+#undef ARITHMETIC_OP
+#undef COMPARISON_OP
+#undef BITWISE_OP
+#undef QUICK_INT_OP
+#undef QUICK_OP
 }
 
 void initVM() {
   resetStack();
-  vm.objects = NULL;
+  initHeap(&vm.heap);
+  vm.sweeping = false;
+  vm.sweepCursor = 0;
+  vm.compactPending = false;
+  vm.compactCount = 0;
+  vm.bytesAllocated = 0;
+  vm.nextGC = 1024 * 1024;
+  vm.gcCount = 0;
+  vm.gcPauseTotal = 0;
+  vm.gcPauseMax = 0;
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
+  vm.out = stdout;
+  vm.err = stderr;
+  vm.rootShape = NULL;
 
   initTable(&vm.strings);
   initTable(&vm.globals);
+  vm.rootShape = newShape(NULL, NULL);
 
-  defineNative("clock", clockNative);
+  defineNatives();
+}
+
+// Gives the next script a fresh global scope while keeping the heap and
+// the interned strings of this VM.
+void resetVM() {
+  resetStack();
+  freeTable(&vm.globals);
+  defineNatives();
 }
 
 void freeVM() {
   resetStack();
   freeTable(&vm.strings);
   freeTable(&vm.globals);
+  freeShape(vm.rootShape);
+  vm.rootShape = NULL;
   freeObjects();
+  freeHeap(&vm.heap);
+  freeCompiler();
 }
 
-void push(Value value) {
-#define STACK_SIZE_INC 256
-  if (vm.stackSize >= vm.stackCapasity) {
-    int oldCapacity = vm.stackCapasity;
-    vm.stackCapasity = vm.stackCapasity + STACK_SIZE_INC;
-    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapasity);
+// Growing the stack must not start a collection, the value being
+// pushed is not rooted yet.
+static void growStack() {
+  int oldCapacity = vm.stackCapasity;
+  vm.stackCapasity = oldCapacity < 256 ? 256 : oldCapacity * 2;
+  vm.stack = (Value*)realloc(vm.stack, sizeof(Value) * vm.stackCapasity);
+  vm.openUpvalues = (ObjUpvalue**)realloc(vm.openUpvalues,
+      sizeof(ObjUpvalue*) * vm.stackCapasity);
+  if (vm.stack == NULL || vm.openUpvalues == NULL) exit(1);
+  memset(vm.openUpvalues + oldCapacity, 0,
+      sizeof(ObjUpvalue*) * (vm.stackCapasity - oldCapacity));
+
+  // Open upvalues point into the old stack.
+  for (int i = 0; i < vm.openTop; i++) {
+    if (vm.openUpvalues[i] != NULL) {
+      vm.openUpvalues[i]->location = &vm.stack[i];
+    }
   }
+}
+
+void push(Value value) {
+  if (vm.stackSize >= vm.stackCapasity) growStack();
   vm.stack[vm.stackSize] = value;
   vm.stackSize++;
-#undef STACK_SIZE_INC
 }
 
 Value pop() {
@@ -397,8 +1105,7 @@ Value pop() {
     return vm.stack[vm.stackSize];
 }
 
-InterpretResult interpret(char* source) {
-  ObjFunction* function = compile(source);
+static InterpretResult runScript(ObjFunction* function) {
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
   push(OBJ_VAL(function));
@@ -409,3 +1116,11 @@ InterpretResult interpret(char* source) {
 
   return run();
 }
+
+InterpretResult interpret(const char* source, size_t length) {
+  return runScript(compile(source, length));
+}
+
+InterpretResult interpretStream(int fd) {
+  return runScript(compileStream(fd));
+}
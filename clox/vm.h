@@ -1,10 +1,14 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <stdio.h>
+
 #include "chunk.h"
+#include "heap.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "shape.h"
 
 #define FRAMES_MAX 64
 
@@ -25,12 +29,28 @@ typedef struct {
   int stackSize;
   int stackCapasity;
 
+  FILE* out;
+  FILE* err;
+
   Table strings;
-  Obj* objects;
+  Heap heap;
+  bool sweeping;
+  int sweepCursor;
+  bool compactPending;
+  int compactCount;
   Table globals;
-  ObjUpvalue* openUpvalues;
+  // The open upvalue of each stack slot, parallel to stack. No slot
+  // from openTop on has one.
+  ObjUpvalue** openUpvalues;
+  int openTop;
+  Shape* rootShape;
 
   // GC
+  size_t bytesAllocated;
+  size_t nextGC;
+  int gcCount;
+  double gcPauseTotal;
+  double gcPauseMax;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
@@ -42,12 +62,17 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+// Every thread runs its own VM, see batch.c.
+extern _Thread_local VM vm;
 
 void initVM();
 void freeVM();
-InterpretResult interpret(char* source);
+void resetVM();
+InterpretResult interpret(const char* source, size_t length);
+InterpretResult interpretStream(int fd);
 void push(Value value);
 Value pop();
+void runtimeError(const char* format, ...);
+void defineNative(const char* name, NativeFn function, int arity);
 
 #endif